@@ -14,166 +14,2443 @@
  * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 #include <X11/Xlib.h>
+#include <X11/Xatom.h>
+#include <X11/Xutil.h>
 #include <X11/extensions/XInput.h>
 #include <X11/extensions/XTest.h>
+#include <X11/extensions/Xrandr.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
 #include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <spawn.h>
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <elf.h>
+#include <link.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
+#include <algorithm>
+#include <bitset>
 #include <list>
+#include <string>
 #include <map>
 #include <set>
+#include <vector>
+
+// USDT probes for perf and bpftrace, just a nop each unless someone attaches
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#endif
+#endif
+#ifndef DTRACE_PROBE4
+#define DTRACE_PROBE1(provider, name, a)
+#define DTRACE_PROBE2(provider, name, a, b)
+#define DTRACE_PROBE3(provider, name, a, b, c)
+#define DTRACE_PROBE4(provider, name, a, b, c, d)
+#define DTRACE_PROBE6(provider, name, a, b, c, d, e, f)
+#endif
 
 Display *dpy;
 #define ROOT (DefaultRootWindow(dpy))
 
-bool debug, always_grab;
-const char *device_name;
+bool debug, always_grab, need_motion, need_monitors, need_clients, prespawn;
+const char *device_name, *metrics_addr;
+
+#define HISTOGRAM_BUCKETS 12
+
+// Upper bounds in us, for latencies and for how long commands run
+extern const long long latency_bounds[HISTOGRAM_BUCKETS];
+extern const long long runtime_bounds[HISTOGRAM_BUCKETS];
+
+// Histogram with fixed buckets, so that recording is just an increment
+template <const long long *bounds>
+struct Histogram {
+	enum { N = HISTOGRAM_BUCKETS };
+	unsigned long buckets[N + 1];
+	long long sum;
+
+	void add(long long us) {
+		int i = 0;
+		while (i < N && us > bounds[i])
+			i++;
+		buckets[i]++;
+		sum += us;
+	}
+
+	unsigned long count() {
+		unsigned long n = 0;
+		for (int i = 0; i <= N; i++)
+			n += buckets[i];
+		return n;
+	}
+
+	// Estimate, interpolating linearly within the bucket, 0 if empty and
+	// -1 if it's beyond the last bound
+	long long quantile(double q) {
+		if (!count())
+			return 0;
+		double rank = q * count();
+		unsigned long seen = 0;
+		for (int i = 0; i < N; i++) {
+			if (buckets[i] && seen + buckets[i] >= rank) {
+				long long lo = i ? bounds[i-1] : 0;
+				return lo + (long long)((bounds[i] - lo) * (rank - seen) / buckets[i]);
+			}
+			seen += buckets[i];
+		}
+		return -1;
+	}
+};
+
+const long long latency_bounds[HISTOGRAM_BUCKETS] = {
+	100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 1000000
+};
+
+const long long runtime_bounds[HISTOGRAM_BUCKETS] = {
+	1000, 5000, 10000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000, 60000000
+};
+
+typedef Histogram<latency_bounds> LatencyHistogram;
+typedef Histogram<runtime_bounds> RuntimeHistogram;
+
+enum { EV_CORE_PRESS, EV_XI_PRESS, EV_XI_RELEASE, EV_TYPES };
+const char *event_types[EV_TYPES] = { "core_press", "xi_press", "xi_release" };
+
+struct Stats {
+	unsigned long events[EV_TYPES];
+	unsigned long combines, replays, grabs, grab_failures;
+	unsigned long wakeups, reconnects;
+	unsigned long spins, spin_hits;	// polls while busy-polling, and the ones that found something
+	long long spin_us;
+	LatencyHistogram spawn;		// time taken by posix_spawn()
+	LatencyHistogram latency;	// from physical input to running the action
+} stats;
+
+/*
+ * With TRACE=<n>, the last n steps of handling events and running commands
+ * are kept in a ring, to be fetched as Chrome trace JSON from /trace on the
+ * METRICS socket.  Recording a step is a few stores into memory allocated
+ * at startup; nothing is formatted until someone asks.
+ */
+struct TraceEvent {
+	const char *name;
+	const char *detail;	// the command, if any
+	long long ts, dur;	// monotonic us, dur is -1 for instants
+	long pid, tid;
+	int button;
+};
+
+TraceEvent *trace_ring;
+unsigned long trace_size, trace_next;
+long trace_pid;
+
+long long now_us();
+
+void trace(const char *name, long long ts, long long dur, long tid, int button = 0,
+		const char *detail = NULL, long pid = 0) {
+	if (!trace_size)
+		return;
+	TraceEvent &e = trace_ring[trace_next++ % trace_size];
+	e.name = name;
+	e.detail = detail;
+	e.ts = ts;
+	e.dur = dur;
+	e.pid = pid ? pid : trace_pid;
+	e.tid = tid;
+	e.button = button;
+}
+
+void init_trace() {
+	const char *n = getenv("TRACE");
+	if (!n || atol(n) <= 0)
+		return;
+	trace_size = atol(n);
+	trace_pid = getpid();
+	trace_ring = (TraceEvent *)calloc(trace_size, sizeof(TraceEvent));
+}
+
+#define MAX_BUTTONS 256
+
+struct Point {
+	float x, y;
+};
+
+struct Commands;
+struct Binding;
+struct Layer;
+struct ClassIndex;
+
+/*
+ * Pointer motion while a button is held.  A fast mouse reports motion a
+ * thousand times per second, so instead of keeping every event we resample
+ * the path to points TRACK_SPACING pixels apart as it comes in.  If the
+ * buffer fills up, every other point is dropped and the spacing doubled, so
+ * both memory and the work per event stay bounded.
+ */
+#define TRACK_POINTS 256		// must be even
+#define TRACK_SPACING 4.0f
+
+struct Track {
+	bool active;
+	int n;
+	float spacing;
+	Point p[TRACK_POINTS];
+	int x0, y0;		// where the button went down
+	Window window;		// and the window it went down on
+
+	void start(int x, int y, Window w) {
+		active = true;
+		x0 = x;
+		y0 = y;
+		window = w;
+		spacing = TRACK_SPACING;
+		p[0].x = x;
+		p[0].y = y;
+		n = 1;
+	}
+
+	void add(float x, float y) {
+		for (;;) {
+			Point &last = p[n-1];
+			float d = hypotf(x - last.x, y - last.y);
+			if (d < spacing)
+				return;
+			if (n == TRACK_POINTS) {
+				// Keep the newest point, the stroke goes on from there
+				Point newest = p[n-1];
+				for (int i = 1; 2*i < n; i++)
+					p[i] = p[2*i];
+				n = (n + 1) / 2;
+				p[n++] = newest;
+				spacing *= 2;
+				continue;
+			}
+			p[n].x = last.x + (x - last.x) * spacing / d;
+			p[n].y = last.y + (y - last.y) * spacing / d;
+			n++;
+		}
+	}
+};
+
+struct XiDevice {
+	XDevice *dev;
+	XEventClass classes[3];
+	int num_classes;
+	int press, release, motion;
+	unsigned int num_buttons;
+	std::bitset<MAX_BUTTONS> status;
+	Commands *held[MAX_BUTTONS];	// what a press was dispatched to
+	Binding *chosen[MAX_BUTTONS];	// and which variant was picked
+	Track track;			// recording a stroke for gestures
+
+	// On-button scrolling: motion is turned into wheel clicks
+	unsigned int scroll_button;	// 0 if not scrolling
+	int scroll_step;		// pixels per click
+	int scroll_x, scroll_y;		// where the pointer is kept
+	int last_x, last_y;
+	int acc_x, acc_y;
+
+	void start_scroll(unsigned int button, int step, int x, int y) {
+		scroll_button = button;
+		scroll_step = step;
+		scroll_x = last_x = x;
+		scroll_y = last_y = y;
+		acc_x = acc_y = 0;
+	}
+
+	void scroll(int x, int y) {
+		acc_x += x - last_x;
+		acc_y += y - last_y;
+		last_x = x;
+		last_y = y;
+		for (; acc_y >= scroll_step; acc_y -= scroll_step)
+			click(5);
+		for (; acc_y <= -scroll_step; acc_y += scroll_step)
+			click(4);
+		for (; acc_x >= scroll_step; acc_x -= scroll_step)
+			click(7);
+		for (; acc_x <= -scroll_step; acc_x += scroll_step)
+			click(6);
+		// Keep the pointer over the window we're scrolling
+		if (abs(x - scroll_x) + abs(y - scroll_y) > 64) {
+			XWarpPointer(dpy, None, ROOT, 0, 0, 0, 0, scroll_x, scroll_y);
+			last_x = scroll_x;
+			last_y = scroll_y;
+		}
+	}
+
+	void click(unsigned int b) {
+		XTestFakeButtonEvent(dpy, b, True, CurrentTime);
+		XTestFakeButtonEvent(dpy, b, False, CurrentTime);
+	}
+
+	// The button and time of the press that made us grab, for tracing
+	void grab(unsigned int button = 0, Time t = CurrentTime) {
+		if (debug)
+			printf("Grabbing device %ld\n", dev->device_id);
+		long long start = now_us();
+		int status = XGrabDevice(dpy, dev, ROOT, False, num_classes, classes,
+				GrabModeAsync, GrabModeAsync, CurrentTime);
+		trace("grab", start, now_us() - start, dev->device_id);
+		stats.grabs++;
+		DTRACE_PROBE4(bindbutton, grab, button, dev->device_id, t, status);
+		if (status != GrabSuccess)
+			stats.grab_failures++;
+		switch (status) {
+			case GrabSuccess:
+				break;
+			case AlreadyGrabbed:
+				printf("Grab error: Already grabbed\n");
+				break;
+			case GrabNotViewable:
+				printf("Grab error: Not viewable\n");
+				break;
+			case GrabFrozen:
+				printf("Grab error: Frozen\n");
+				break;
+			case GrabInvalidTime:
+				printf("Grab error: Invalid Time\n");
+				break;
+			default:
+				printf("Grab error: Unknown\n");
+		}
+	}
+
+	void ungrab(unsigned int button, Time t) {
+		if (debug)
+			printf("Ungrabbing device %ld\n", dev->device_id);
+		XUngrabDevice(dpy, dev, CurrentTime);
+		DTRACE_PROBE3(bindbutton, ungrab, button, dev->device_id, t);
+	}
+};
+
+std::list<XiDevice> devices;
+
+/*
+ * Event timestamps are X server time: milliseconds since some point only the
+ * server knows, wrapping every 49.7 days.  To compute how long an event took
+ * to reach us, we relate it to CLOCK_MONOTONIC by appending nothing to a
+ * property on a private window and timestamping the resulting PropertyNotify.
+ * The server stamped it somewhere between sending the request and reading the
+ * reply, so the sample with the smallest round trip is the most accurate.
+ */
+#define CLOCK_REFRESH 60000000LL	// take a new sample after this many us
+#define CLOCK_STALE 600000000LL		// accept a worse sample after this many us
+
+Window clock_win;
+Atom clock_atom;
+Time clock_server;		// server time of the best sample
+long long clock_mono;		// corresponding monotonic time in us
+long long clock_rtt = -1;	// round trip of the best sample, -1 if none
+long long clock_taken;		// when the best sample was taken
+long long clock_sent;		// when the pending request was sent, 0 if none
+long long clock_requested;	// when the last request was sent
+
+long long now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+void clock_request() {
+	XChangeProperty(dpy, clock_win, clock_atom, XA_INTEGER, 32,
+			PropModeAppend, NULL, 0);
+	clock_sent = clock_requested = now_us();
+	XFlush(dpy);
+}
+
+void clock_sample(Time t) {
+	long long now = now_us();
+	long long rtt = now - clock_sent;
+	if (clock_rtt < 0 || rtt <= clock_rtt || now - clock_taken > CLOCK_STALE) {
+		clock_server = t;
+		clock_mono = clock_sent + rtt / 2;
+		clock_rtt = rtt;
+		clock_taken = now;
+		if (debug)
+			printf("Clock sample: server %lu, round trip %lldus\n", t, rtt);
+	}
+	clock_sent = 0;
+}
+
+// Refine the offset, but only when there is activity anyway, and whether or
+// not the last sample was better, at most once per CLOCK_REFRESH
+void clock_refresh() {
+	if (!clock_sent && now_us() - clock_requested > CLOCK_REFRESH)
+		clock_request();
+}
+
+long long server_to_mono(Time t) {
+	return clock_mono + (int32_t)(uint32_t)(t - clock_server) * 1000LL;
+}
+
+void init_clock() {
+	clock_win = XCreateSimpleWindow(dpy, ROOT, 0, 0, 1, 1, 0, 0, 0);
+	XSelectInput(dpy, clock_win, PropertyChangeMask);
+	clock_atom = XInternAtom(dpy, "BINDBUTTON_CLOCK", False);
+	for (int i = 0; i < 3; i++) {
+		XEvent ev;
+		clock_request();
+		XWindowEvent(dpy, clock_win, PropertyChangeMask, &ev);
+		clock_sample(ev.xproperty.time);
+	}
+}
+
+/*
+ * Anything that needs to happen later gets a timer.  A timer must only be
+ * armed while there is actually something pending: with none armed we sleep
+ * in poll() without a timeout, so an idle bindbutton never wakes up.
+ */
+struct Timer {
+	long long when;		// monotonic us, 0 if not armed
+	void (*fire)();
+};
+
+std::vector<Timer *> timers;
+
+void arm(Timer &timer, long long delay) {
+	timer.when = now_us() + delay;
+}
+
+// Milliseconds until the next timer is due, -1 if none is armed
+int poll_timeout() {
+	long long next = 0;
+	for (std::vector<Timer *>::iterator i = timers.begin(); i != timers.end(); i++)
+		if ((*i)->when && (!next || (*i)->when < next))
+			next = (*i)->when;
+	if (!next)
+		return -1;
+	long long now = now_us();
+	return next > now ? (next - now + 999) / 1000 : 0;
+}
+
+void run_timers() {
+	long long now = now_us();
+	for (std::vector<Timer *>::iterator i = timers.begin(); i != timers.end(); i++)
+		if ((*i)->when && (*i)->when <= now) {
+			(*i)->when = 0;
+			(*i)->fire();
+		}
+}
+
+// File descriptors to wait on besides the X connection
+#define MAX_WATCHES 8
+
+struct Watch {
+	int fd;			// -1 if there is nothing to watch
+	void (*ready)(void *data);
+	void *data;
+};
+
+std::vector<Watch *> watches;
+
+/*
+ * What to do on a press or release: usually a shell command, but a command
+ * starting with '@' names something bindbutton does by itself:
+ *   @scroll [<pixels>]	turn motion into wheel clicks while the button is held
+ *   @layer <name>	switch to a layer, or back to the base layer
+ *   @latch <button>	press a button on one press, release it on the next
+ *   @close, @minimize, @maximize
+ *			close, iconify or toggle maximization of the window
+ *			under the pointer
+ *   @desktop <n>	move the window under the pointer to desktop n
+ *   @switch <n>	switch to desktop n
+ *   @raise <class> <command>
+ *			activate a window of that class, or run the command
+ *			if there is none
+ *   @send <class> key <keysym>, @send <class> button <n>
+ *			send a key or button click to a window of that class
+ *			without focusing it
+ *   @write <file> <text>
+ *			write a line to a FIFO or sysfs attribute, like
+ *			echo <text> > <file>; regular files are overwritten
+ *			from the start but not truncated
+ *   @dbus [--system] <destination> <path> <interface.method> [<type>:<value>]...
+ *   @dbus-signal [--system] <path> <interface.signal> [<type>:<value>]...
+ *			call a method or emit a signal like dbus-send, with
+ *			arguments of type string, objpath, boolean, byte,
+ *			int32, uint32 or double
+ */
+enum {
+	ACT_NONE, ACT_CMD, ACT_SCROLL, ACT_LAYER, ACT_LATCH,
+	ACT_CLOSE, ACT_MINIMIZE, ACT_MAXIMIZE, ACT_DESKTOP, ACT_SWITCH, ACT_RAISE,
+	ACT_SEND, ACT_WRITE, ACT_DBUS
+};
+
+struct Action {
+	const char *cmd;	// as given on the command line
+	const char *exec;	// what to pass to the shell, if anything
+	const char *binary;	// the program exec starts, if we could find it
+	char **argv;		// if exec is simple enough to do without the shell
+	int type;
+	int arg;
+	Layer *layer;
+	ClassIndex *index;
+	XEvent *event;		// for @send, everything but the window filled in
+	const char *path;	// for @write
+	char *data;		// what @write and @dbus send, prepared up front
+	int len;
+	int fd;			// kept open, -1 if not open
+	bool seekable;
+	bool latched;
+	pid_t parked;		// a shell waiting for the release, or 0
+	int trigger;		// the pipe it waits on
+	char *script;		// exec, but waiting for the trigger first
+	unsigned long runs, failures;
+	LatencyHistogram launch;	// from physical input until the child was started
+	RuntimeHistogram runtime;	// from starting the child until it exited
+	unsigned long exits[256], signals;
+};
+
+/*
+ * Gestures are compared as fixed-size point arrays: the stroke is resampled
+ * to GESTURE_POINTS points evenly spaced along its path, moved so that its
+ * centroid is at the origin and scaled to fit the unit square.  Templates are
+ * written as a sequence of directions, e.g. "L" or "DR", and go through the
+ * same normalization.
+ */
+#define GESTURE_POINTS 32		// must be a multiple of 4
+#define GESTURE_MIN_LENGTH 24.0f	// shorter strokes are clicks, in pixels
+#define GESTURE_MAX_DIST 0.06f		// mean squared distance per point
+
+struct Shape {
+	float x[GESTURE_POINTS] __attribute__((aligned(16)));
+	float y[GESTURE_POINTS] __attribute__((aligned(16)));
+};
+
+// Returns false if the stroke is too short to be a gesture
+bool make_shape(const Point *p, int n, float min_length, Shape &shape) {
+	float length = 0;
+	for (int i = 1; i < n; i++)
+		length += hypotf(p[i].x - p[i-1].x, p[i].y - p[i-1].y);
+	if (n < 2 || length < min_length)
+		return false;
+
+	float step = length / (GESTURE_POINTS - 1);
+	float left = 0;		// distance to walk to the next sample
+	int k = 0, i = 1;
+	Point cur = p[0];
+	while (k < GESTURE_POINTS && i < n) {
+		float d = hypotf(p[i].x - cur.x, p[i].y - cur.y);
+		if (d >= left && d > 0) {
+			cur.x += (p[i].x - cur.x) * left / d;
+			cur.y += (p[i].y - cur.y) * left / d;
+			shape.x[k] = cur.x;
+			shape.y[k] = cur.y;
+			k++;
+			left = step;
+		} else {
+			left -= d;
+			cur = p[i++];
+		}
+	}
+	for (; k < GESTURE_POINTS; k++) {
+		shape.x[k] = p[n-1].x;
+		shape.y[k] = p[n-1].y;
+	}
+
+	float cx = 0, cy = 0;
+	float x0 = shape.x[0], x1 = x0, y0 = shape.y[0], y1 = y0;
+	for (k = 0; k < GESTURE_POINTS; k++) {
+		cx += shape.x[k];
+		cy += shape.y[k];
+		x0 = fminf(x0, shape.x[k]);
+		x1 = fmaxf(x1, shape.x[k]);
+		y0 = fminf(y0, shape.y[k]);
+		y1 = fmaxf(y1, shape.y[k]);
+	}
+	cx /= GESTURE_POINTS;
+	cy /= GESTURE_POINTS;
+	float scale = fmaxf(x1 - x0, y1 - y0);
+	for (k = 0; k < GESTURE_POINTS; k++) {
+		shape.x[k] = (shape.x[k] - cx) / scale;
+		shape.y[k] = (shape.y[k] - cy) / scale;
+	}
+	return true;
+}
+
+Shape *parse_gesture(const char *dirs) {
+	std::vector<Point> p;
+	Point cur = { 0, 0 };
+	p.push_back(cur);
+	for (; *dirs; dirs++) {
+		switch (*dirs) {
+			case 'U': case 'u': cur.y -= 1; break;
+			case 'D': case 'd': cur.y += 1; break;
+			case 'L': case 'l': cur.x -= 1; break;
+			case 'R': case 'r': cur.x += 1; break;
+			default: return NULL;
+		}
+		p.push_back(cur);
+	}
+	Shape *shape = new Shape;
+	if (!make_shape(&p[0], p.size(), 1, *shape)) {
+		delete shape;
+		return NULL;
+	}
+	return shape;
+}
+
+// Mean squared distance between corresponding points, four at a time
+typedef float v4sf __attribute__((vector_size(16)));
+
+float shape_distance(const Shape &a, const Shape &b) {
+	const v4sf *ax = (const v4sf *)a.x, *ay = (const v4sf *)a.y;
+	const v4sf *bx = (const v4sf *)b.x, *by = (const v4sf *)b.y;
+	v4sf sum = { 0, 0, 0, 0 };
+	for (int i = 0; i < GESTURE_POINTS / 4; i++) {
+		v4sf dx = ax[i] - bx[i];
+		v4sf dy = ay[i] - by[i];
+		sum += dx * dx + dy * dy;
+	}
+	return (sum[0] + sum[1] + sum[2] + sum[3]) / GESTURE_POINTS;
+}
+
+/*
+ * Monitor layout, cached from RandR and only refreshed on RRScreenChangeNotify.
+ * To find the monitor under the pointer without walking the list, the screen
+ * is divided into GRID_SIZE pixel cells, each holding a bit mask of the
+ * monitors overlapping it.
+ */
+#define MAX_MONITORS 32
+#define GRID_SHIFT 6
+#define EDGE_SIZE 2		// how close to a monitor edge counts as the edge
+
+enum { EDGE_LEFT = 1, EDGE_RIGHT = 2, EDGE_TOP = 4, EDGE_BOTTOM = 8 };
+
+struct Monitor {
+	char name[32];
+	int x, y, w, h;
+};
+
+int rr_event_base;
+Monitor monitors[MAX_MONITORS];
+int num_monitors;
+std::vector<uint32_t> grid;
+int grid_cols, grid_rows;
+
+// Index of the monitor containing (x, y), or -1
+int find_monitor(int x, int y) {
+	if (x < 0 || y < 0 || (x >> GRID_SHIFT) >= grid_cols || (y >> GRID_SHIFT) >= grid_rows)
+		return -1;
+	uint32_t mask = grid[(y >> GRID_SHIFT) * grid_cols + (x >> GRID_SHIFT)];
+	for (int i = 0; mask; i++, mask >>= 1) {
+		Monitor &m = monitors[i];
+		if ((mask & 1) && x >= m.x && x < m.x + m.w && y >= m.y && y < m.y + m.h)
+			return i;
+	}
+	return -1;
+}
+
+// Which edges of its monitor (x, y) is at
+int find_edges(int monitor, int x, int y) {
+	if (monitor < 0)
+		return 0;
+	Monitor &m = monitors[monitor];
+	int edges = 0;
+	if (x < m.x + EDGE_SIZE)
+		edges |= EDGE_LEFT;
+	if (x >= m.x + m.w - EDGE_SIZE)
+		edges |= EDGE_RIGHT;
+	if (y < m.y + EDGE_SIZE)
+		edges |= EDGE_TOP;
+	if (y >= m.y + m.h - EDGE_SIZE)
+		edges |= EDGE_BOTTOM;
+	return edges;
+}
+
+/*
+ * A binding is written <button>[:<qualifier>]... on the command line.
+ * Qualifiers are
+ *   gesture=<directions>	fire on release after drawing that stroke
+ *   layer=<name>		only active while that layer is
+ *   toggle			alternate between the press and release command
+ *				on successive presses
+ *   region=<region>		only fire with the pointer on a monitor, given by
+ *				its RandR name, or at an edge or corner of the
+ *				monitor: left, top-right, etc.
+ *   class=<class>		only fire over windows with this WM_CLASS name
+ *				or class
+ */
+struct Binding {
+	const char *spec;	// as given on the command line
+	unsigned int button;
+	Shape *gesture;		// NULL unless this is a gesture binding
+	Layer *layer;
+	bool toggle, toggled;
+	const char *monitor_name;	// NULL if any monitor will do
+	int monitor;			// its index, -1 if it isn't connected
+	int edges;			// EDGE_* that all have to match
+	const char *class_name;		// NULL if any window will do
+	Action press;
+	Action release;
+};
+
+// Everything bound to one button
+struct Commands {
+	Binding *plain;
+	std::vector<Binding *> variants;	// bindings with conditions, tried first
+	std::vector<Binding *> gestures;
+};
+
+/*
+ * Each layer is compiled into a flat table indexed by button.  Buttons that
+ * a layer doesn't bind fall through to the base layer, whose name is "".
+ */
+struct Layer {
+	const char *name;
+	Commands *buttons[MAX_BUTTONS];
+};
+
+std::list<Binding> bindings;
+std::list<Layer> layers;
+Layer *current_layer;
+
+/*
+ * Button events tell us the top-level window under the pointer, but its
+ * WM_CLASS lives on the client window, possibly somewhere below a window
+ * manager frame.  Finding it takes round trips, so the result is kept in a
+ * small LRU cache.  We listen for DestroyNotify on the frame and
+ * PropertyNotify on the client to drop entries that are no longer valid.
+ */
+#define CLASS_CACHE 32
+
+struct WindowClass {
+	Window frame;		// the child of the root
+	Window client;		// the window WM_CLASS was found on
+	char res_name[64], res_class[64];
+	unsigned long used;	// for LRU, 0 if the slot is free
+};
+
+WindowClass class_cache[CLASS_CACHE];
+unsigned long class_clock;
+
+XErrorHandler fatal_x_error;
+
+int x_error(Display *d, XErrorEvent *ev) {
+	// Windows we ask about can disappear at any time, anything else is fatal as before
+	if (ev->error_code != BadWindow)
+		return fatal_x_error(d, ev);
+	if (debug)
+		printf("X error: BadWindow for window 0x%lx\n", ev->resourceid);
+	return 0;
+}
+
+// Look for WM_CLASS on w or the windows below it
+Window find_client(Window w, XClassHint &hint, int depth) {
+	if (XGetClassHint(dpy, w, &hint))
+		return w;
+	if (!depth)
+		return None;
+	Window root, parent, *children, found = None;
+	unsigned int n;
+	if (!XQueryTree(dpy, w, &root, &parent, &children, &n))
+		return None;
+	for (unsigned int i = n; i-- && !found;)
+		found = find_client(children[i], hint, depth - 1);
+	if (children)
+		XFree(children);
+	return found;
+}
+
+WindowClass *window_class(Window frame) {
+	if (!frame)
+		return NULL;
+	WindowClass *lru = class_cache;
+	for (int i = 0; i < CLASS_CACHE; i++) {
+		WindowClass &wc = class_cache[i];
+		if (wc.used && wc.frame == frame) {
+			wc.used = ++class_clock;
+			return &wc;
+		}
+		if (wc.used < lru->used)
+			lru = &wc;
+	}
+	// Windows without a class are cached too, with an empty one
+	XClassHint hint = { NULL, NULL };
+	Window client = find_client(frame, hint, 2);
+	if (!client)
+		client = frame;
+	if (lru->used) {
+		XSelectInput(dpy, lru->frame, NoEventMask);
+		XSelectInput(dpy, lru->client, NoEventMask);
+	}
+	lru->frame = frame;
+	lru->client = client;
+	snprintf(lru->res_name, sizeof(lru->res_name), "%s", hint.res_name ? hint.res_name : "");
+	snprintf(lru->res_class, sizeof(lru->res_class), "%s", hint.res_class ? hint.res_class : "");
+	if (hint.res_name)
+		XFree(hint.res_name);
+	if (hint.res_class)
+		XFree(hint.res_class);
+	lru->used = ++class_clock;
+	if (client == frame) {
+		XSelectInput(dpy, frame, StructureNotifyMask | PropertyChangeMask);
+	} else {
+		XSelectInput(dpy, frame, StructureNotifyMask);
+		XSelectInput(dpy, client, PropertyChangeMask);
+	}
+	if (debug)
+		printf("Window 0x%lx has class %s.%s\n", frame, lru->res_name, lru->res_class);
+	return lru;
+}
+
+void forget_window(Window w) {
+	for (int i = 0; i < CLASS_CACHE; i++) {
+		WindowClass &wc = class_cache[i];
+		if (wc.used && (wc.frame == w || wc.client == w)) {
+			XSelectInput(dpy, wc.frame, NoEventMask);
+			XSelectInput(dpy, wc.client, NoEventMask);
+			wc.used = 0;
+		}
+	}
+}
+
+// Atoms for talking to the window manager, interned in one go
+enum {
+	NET_CLOSE_WINDOW, NET_WM_STATE, NET_WM_STATE_MAXIMIZED_VERT,
+	NET_WM_STATE_MAXIMIZED_HORZ, NET_WM_DESKTOP, NET_CURRENT_DESKTOP,
+	NET_ACTIVE_WINDOW, NET_CLIENT_LIST, WM_CHANGE_STATE, NUM_ATOMS
+};
+
+const char *atom_names[NUM_ATOMS] = {
+	"_NET_CLOSE_WINDOW", "_NET_WM_STATE", "_NET_WM_STATE_MAXIMIZED_VERT",
+	"_NET_WM_STATE_MAXIMIZED_HORZ", "_NET_WM_DESKTOP", "_NET_CURRENT_DESKTOP",
+	"_NET_ACTIVE_WINDOW", "_NET_CLIENT_LIST", "WM_CHANGE_STATE"
+};
+
+Atom atoms[NUM_ATOMS];
+
+void init_atoms() {
+	XInternAtoms(dpy, (char **)atom_names, NUM_ATOMS, False, atoms);
+}
+
+// Send a client message to the window manager, source indication "pager"
+void send_wm(Window w, int atom, long d0, long d1 = 0, long d2 = 0, long d3 = 0) {
+	XEvent ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.xclient.type = ClientMessage;
+	ev.xclient.window = w;
+	ev.xclient.message_type = atoms[atom];
+	ev.xclient.format = 32;
+	ev.xclient.data.l[0] = d0;
+	ev.xclient.data.l[1] = d1;
+	ev.xclient.data.l[2] = d2;
+	ev.xclient.data.l[3] = d3;
+	XSendEvent(dpy, ROOT, False, SubstructureRedirectMask | SubstructureNotifyMask, &ev);
+}
+
+/*
+ * For run-or-raise we track the window manager's client list.  It is only
+ * fetched when the root's _NET_CLIENT_LIST changes, and only windows that
+ * are new since the last time are asked for their class.  Each class that
+ * some binding wants to raise has an index entry listing its windows, so a
+ * press just looks at that list.
+ */
+struct ClassIndex {
+	const char *name;
+	std::vector<Window> windows;	// in the order we saw them
+};
+
+std::list<ClassIndex> class_index;
+std::set<Window> clients;
+
+ClassIndex *get_class_index(const char *name) {
+	for (std::list<ClassIndex>::iterator i = class_index.begin(); i != class_index.end(); i++)
+		if (!strcasecmp(i->name, name))
+			return &*i;
+	ClassIndex c;
+	c.name = name;
+	class_index.push_back(c);
+	return &class_index.back();
+}
+
+void update_clients() {
+	Atom type;
+	int format;
+	unsigned long n, left;
+	unsigned char *data = NULL;
+	if (XGetWindowProperty(dpy, ROOT, atoms[NET_CLIENT_LIST], 0, 65536, False, XA_WINDOW,
+				&type, &format, &n, &left, &data) != Success || format != 32)
+		n = 0;
+	Window *list = (Window *)data;
+
+	for (std::set<Window>::iterator i = clients.begin(); i != clients.end();) {
+		if (std::find(list, list + n, *i) != list + n) {
+			i++;
+			continue;
+		}
+		for (std::list<ClassIndex>::iterator c = class_index.begin(); c != class_index.end(); c++) {
+			std::vector<Window>::iterator j = std::find(c->windows.begin(), c->windows.end(), *i);
+			if (j != c->windows.end())
+				c->windows.erase(j);
+		}
+		clients.erase(i++);
+	}
+	// No C++ objects alive from here on, see io_error()
+	for (unsigned long k = 0; k < n; k++) {
+		if (!clients.insert(list[k]).second)
+			continue;
+		XClassHint hint;
+		if (!XGetClassHint(dpy, list[k], &hint))
+			continue;
+		for (std::list<ClassIndex>::iterator c = class_index.begin(); c != class_index.end(); c++)
+			if (!strcasecmp(c->name, hint.res_class) || !strcasecmp(c->name, hint.res_name))
+				c->windows.push_back(list[k]);
+		XFree(hint.res_name);
+		XFree(hint.res_class);
+	}
+	if (data)
+		XFree(data);
+}
+
+void init_clients() {
+	if (!need_clients)
+		return;
+	clients.clear();
+	for (std::list<ClassIndex>::iterator c = class_index.begin(); c != class_index.end(); c++)
+		c->windows.clear();
+	XSelectInput(dpy, ROOT, PropertyChangeMask);
+	update_clients();
+}
+
+void load_monitors() {
+	int n;
+	XRRMonitorInfo *info = XRRGetMonitors(dpy, ROOT, True, &n);
+	num_monitors = 0;
+	int width = 0, height = 0;
+	for (int i = 0; i < n && num_monitors < MAX_MONITORS; i++) {
+		Monitor &m = monitors[num_monitors++];
+		char *name = XGetAtomName(dpy, info[i].name);
+		snprintf(m.name, sizeof(m.name), "%s", name ? name : "");
+		XFree(name);
+		m.x = info[i].x;
+		m.y = info[i].y;
+		m.w = info[i].width;
+		m.h = info[i].height;
+		width = std::max(width, m.x + m.w);
+		height = std::max(height, m.y + m.h);
+		if (debug)
+			printf("Monitor %s: %dx%d+%d+%d\n", m.name, m.w, m.h, m.x, m.y);
+	}
+	if (info)
+		XRRFreeMonitors(info);
+
+	grid_cols = (width >> GRID_SHIFT) + 1;
+	grid_rows = (height >> GRID_SHIFT) + 1;
+	grid.assign(grid_cols * grid_rows, 0);
+	for (int i = 0; i < num_monitors; i++) {
+		Monitor &m = monitors[i];
+		if (m.w <= 0 || m.h <= 0)
+			continue;
+		for (int r = std::max(m.y, 0) >> GRID_SHIFT; r <= (m.y + m.h - 1) >> GRID_SHIFT; r++)
+			for (int c = std::max(m.x, 0) >> GRID_SHIFT; c <= (m.x + m.w - 1) >> GRID_SHIFT; c++)
+				grid[r * grid_cols + c] |= 1u << i;
+	}
+
+	for (std::list<Binding>::iterator i = bindings.begin(); i != bindings.end(); i++) {
+		if (!i->monitor_name)
+			continue;
+		i->monitor = -1;
+		for (int j = 0; j < num_monitors; j++)
+			if (!strcmp(monitors[j].name, i->monitor_name))
+				i->monitor = j;
+	}
+}
+
+void init_randr() {
+	if (!need_monitors)
+		return;
+	int error_base;
+	if (!XRRQueryExtension(dpy, &rr_event_base, &error_base)) {
+		printf("Error: RandR is not available\n");
+		exit(EXIT_FAILURE);
+	}
+	XRRSelectInput(dpy, ROOT, RRScreenChangeNotifyMask);
+	load_monitors();
+}
+
+const char *edge_names[] = {
+	"left", "right", "top", "bottom", "top-left", "top-right", "bottom-left", "bottom-right", NULL
+};
+const int edge_masks[] = {
+	EDGE_LEFT, EDGE_RIGHT, EDGE_TOP, EDGE_BOTTOM, EDGE_TOP | EDGE_LEFT,
+	EDGE_TOP | EDGE_RIGHT, EDGE_BOTTOM | EDGE_LEFT, EDGE_BOTTOM | EDGE_RIGHT
+};
+
+void parse_region(Binding &b, const char *region) {
+	for (int i = 0; edge_names[i]; i++)
+		if (!strcmp(region, edge_names[i])) {
+			b.edges = edge_masks[i];
+			return;
+		}
+	b.monitor_name = region;
+}
+
+Layer *get_layer(const char *name) {
+	for (std::list<Layer>::iterator i = layers.begin(); i != layers.end(); i++)
+		if (!strcmp(i->name, name))
+			return &*i;
+	Layer l;
+	memset(&l, 0, sizeof(l));
+	l.name = name;
+	layers.push_back(l);
+	return &layers.back();
+}
+
+void init_xi() {
+	int n;
+	XDeviceInfo *devs = XListInputDevices(dpy, &n);
+	if (!devs)
+		exit(EXIT_FAILURE);
+
+	for (int i = 0; i < n; i++) {
+		if (devs[i].use == IsXKeyboard || devs[i].use == IsXPointer)
+			continue;
+
+		XiDevice dev;
+
+		dev.num_buttons = 0;
+		XAnyClassPtr any = (XAnyClassPtr) (devs[i].inputclassinfo);
+		for (int j = 0; j < devs[i].num_classes; j++) {
+			if (any->c_class == ButtonClass) {
+				XButtonInfo *info = (XButtonInfo *)any;
+				dev.num_buttons = info->num_buttons;
+			}
+			any = (XAnyClassPtr) ((char *) any + any->length);
+		}
+		if (!dev.num_buttons)
+			continue;
+
+		if (device_name && strcasecmp(device_name, devs[i].name))
+			continue;
+
+		dev.dev = XOpenDevice(dpy, devs[i].id);
+		if (!dev.dev) {
+			printf("Opening Device %s failed.\n", devs[i].name);
+			continue;
+		}
+
+		DeviceButtonPress(dev.dev, dev.press, dev.classes[0]);
+		DeviceButtonRelease(dev.dev, dev.release, dev.classes[1]);
+		dev.num_classes = 2;
+		dev.motion = -1;
+		dev.track.active = false;
+		dev.scroll_button = 0;
+		memset(dev.held, 0, sizeof(dev.held));
+		memset(dev.chosen, 0, sizeof(dev.chosen));
+		if (need_motion) {
+			DeviceMotionNotify(dev.dev, dev.motion, dev.classes[2]);
+			dev.num_classes = 3;
+		}
+
+		devices.push_back(dev);
+	}
+	XFreeDeviceList(devs);
+	if (devices.size() == 0) {
+		printf("Error: No devices found\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void usage(const char *cmd) {
+	printf("Usage: %s <button 1> <press command 1> <release command 1>\n", cmd);
+	printf("          [<button 2> <press command 2> <release command 2>]...\n");
+	printf("       A button can be qualified as <button>:gesture=<directions>,\n");
+	printf("       e.g. 9:gesture=LR, to bind a stroke drawn while holding it,\n");
+	printf("       as <button>:layer=<name> to bind it in a layer only, and as\n");
+	printf("       <button>:toggle to alternate between the two commands, and as\n");
+	printf("       <button>:region=<monitor|left|top-right|...> for pointer positions\n");
+	printf("       and <button>:class=<WM_CLASS> for the window under the pointer\n");
+	printf("   or: %s --profile\n", cmd);
+}
+
+int print_profile();
+
+/*
+ * A minimal D-Bus client: one connection per bus, opened the first time it is
+ * needed and kept.  Messages are marshalled completely when the command line
+ * is parsed; sending one only means patching in the serial number.  We never
+ * wait for replies, and whatever the bus sends us is read and thrown away.
+ */
+enum { DBUS_METHOD_CALL = 1, DBUS_SIGNAL = 4 };
+enum { DBUS_NO_REPLY_EXPECTED = 1 };
+enum { DBUS_PATH = 1, DBUS_INTERFACE = 2, DBUS_MEMBER = 3, DBUS_DESTINATION = 6, DBUS_SIGNATURE = 8 };
+
+struct Marshal {
+	std::string buf;
+
+	void align(size_t n) {
+		while (buf.size() % n)
+			buf += '\0';
+	}
+	void raw(const void *p, size_t n, size_t alignment) {
+		align(alignment);
+		buf.append((const char *)p, n);
+	}
+	void u8(uint8_t v) { raw(&v, 1, 1); }
+	void u32(uint32_t v) { raw(&v, 4, 4); }
+	void str(const char *s) {
+		u32(strlen(s));
+		buf.append(s, strlen(s) + 1);
+	}
+	void sig(const char *s) {
+		u8(strlen(s));
+		buf.append(s, strlen(s) + 1);
+	}
+	void field(uint8_t code, const char *type, const char *value) {
+		align(8);
+		u8(code);
+		sig(type);
+		if (*type == 'g')
+			sig(value);
+		else
+			str(value);
+	}
+};
+
+// Native byte order, so the endianness flag depends on the host
+bool dbus_message(std::string &out, int type, const char *dest, const char *path,
+		const char *member, char **args, int nargs) {
+	const char *dot = strrchr(member, '.');
+	if (!dot || dot == member || !dot[1] || *path != '/')
+		return false;
+	std::string iface(member, dot - member);
+
+	Marshal body;
+	std::string signature;
+	for (int i = 0; i < nargs; i++) {
+		char *value = strchr(args[i], ':');
+		if (!value)
+			return false;
+		*value++ = 0;
+		if (!strcmp(args[i], "string")) {
+			signature += 's';
+			body.str(value);
+		} else if (!strcmp(args[i], "objpath")) {
+			signature += 'o';
+			body.str(value);
+		} else if (!strcmp(args[i], "boolean")) {
+			signature += 'b';
+			body.u32(!strcmp(value, "true"));
+		} else if (!strcmp(args[i], "byte")) {
+			signature += 'y';
+			body.u8(strtoul(value, NULL, 0));
+		} else if (!strcmp(args[i], "int32")) {
+			int32_t v = strtol(value, NULL, 0);
+			signature += 'i';
+			body.raw(&v, 4, 4);
+		} else if (!strcmp(args[i], "uint32")) {
+			signature += 'u';
+			body.u32(strtoul(value, NULL, 0));
+		} else if (!strcmp(args[i], "double")) {
+			double v = strtod(value, NULL);
+			signature += 'd';
+			body.raw(&v, 8, 8);
+		} else {
+			return false;
+		}
+	}
+
+	uint32_t one = 1;
+	Marshal m;
+	m.u8(*(char *)&one ? 'l' : 'B');
+	m.u8(type);
+	m.u8(type == DBUS_METHOD_CALL ? DBUS_NO_REPLY_EXPECTED : 0);
+	m.u8(1);
+	m.u32(body.buf.size());
+	m.u32(0);	// serial, filled in when sending
+	m.u32(0);	// length of the header fields
+	m.align(8);
+	size_t start = m.buf.size();
+	m.field(DBUS_PATH, "o", path);
+	m.field(DBUS_INTERFACE, "s", iface.c_str());
+	m.field(DBUS_MEMBER, "s", dot + 1);
+	if (dest)
+		m.field(DBUS_DESTINATION, "s", dest);
+	if (!signature.empty())
+		m.field(DBUS_SIGNATURE, "g", signature.c_str());
+	uint32_t fields = m.buf.size() - start;
+	m.buf.replace(12, 4, (const char *)&fields, 4);
+	m.align(8);
+	out = m.buf + body.buf;
+	return true;
+}
+
+struct Bus {
+	bool system;
+	Watch watch;
+	uint32_t serial;
+	std::string hello;
+} buses[2] = { { false, { -1, NULL, NULL }, 0, "" }, { true, { -1, NULL, NULL }, 0, "" } };
+
+void bus_close(Bus &bus) {
+	if (bus.watch.fd >= 0)
+		close(bus.watch.fd);
+	bus.watch.fd = -1;
+}
+
+// Nobody is interested in what the bus has to say
+void bus_ready(void *data) {
+	Bus &bus = *(Bus *)data;
+	char buf[4096];
+	ssize_t n = recv(bus.watch.fd, buf, sizeof(buf), MSG_DONTWAIT);
+	if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+		bus_close(bus);
+}
+
+bool bus_write(Bus &bus, const char *data, size_t len) {
+	return send(bus.watch.fd, data, len, MSG_NOSIGNAL | MSG_DONTWAIT) == (ssize_t)len;
+}
+
+bool bus_open(Bus &bus) {
+	const char *addr = getenv(bus.system ? "DBUS_SYSTEM_BUS_ADDRESS" : "DBUS_SESSION_BUS_ADDRESS");
+	char fallback[64];
+	if (!addr) {
+		if (bus.system)
+			snprintf(fallback, sizeof(fallback), "unix:path=/var/run/dbus/system_bus_socket");
+		else
+			snprintf(fallback, sizeof(fallback), "unix:path=/run/user/%d/bus", (int)getuid());
+		addr = fallback;
+	}
+	struct sockaddr_un un;
+	memset(&un, 0, sizeof(un));
+	un.sun_family = AF_UNIX;
+	const char *p, *path;
+	bool abstract = false;
+	if ((p = strstr(addr, "unix:path=")))
+		path = p + 10;
+	else if ((p = strstr(addr, "unix:abstract=")))
+		path = p + 14, abstract = true;
+	else
+		return false;
+	size_t len = strcspn(path, ",;");
+	if (len + 1 >= sizeof(un.sun_path))
+		return false;
+	memcpy(un.sun_path + abstract, path, len);
+	socklen_t addr_len = offsetof(struct sockaddr_un, sun_path) + abstract + len;
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return false;
+	bus.watch.fd = fd;
+	struct timeval tv = { 1, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if (connect(fd, (struct sockaddr *)&un, addr_len) < 0) {
+		bus_close(bus);
+		return false;
+	}
+
+	char auth[64], uid[16], reply[128];
+	int n = snprintf(uid, sizeof(uid), "%d", (int)getuid());
+	int m = snprintf(auth, sizeof(auth), "%cAUTH EXTERNAL ", 0);
+	for (int i = 0; i < n; i++)
+		m += snprintf(auth + m, sizeof(auth) - m, "%02x", uid[i]);
+	m += snprintf(auth + m, sizeof(auth) - m, "\r\n");
+	ssize_t got = 0;
+	if (!bus_write(bus, auth, m) || (got = read(fd, reply, sizeof(reply) - 1)) < 2 ||
+			strncmp(reply, "OK", 2) || !bus_write(bus, "BEGIN\r\n", 7)) {
+		bus_close(bus);
+		return false;
+	}
+	bus.serial = 1;
+	if (bus.hello.empty())
+		dbus_message(bus.hello, DBUS_METHOD_CALL, "org.freedesktop.DBus",
+				"/org/freedesktop/DBus", "org.freedesktop.DBus.Hello", NULL, 0);
+	memcpy(&bus.hello[8], &bus.serial, 4);
+	if (!bus_write(bus, bus.hello.data(), bus.hello.size())) {
+		bus_close(bus);
+		return false;
+	}
+	bus.watch.ready = bus_ready;
+	bus.watch.data = &bus;
+	if (std::find(watches.begin(), watches.end(), &bus.watch) == watches.end())
+		watches.push_back(&bus.watch);
+	return true;
+}
+
+bool bus_send(Bus &bus, Action &a) {
+	if (bus.watch.fd < 0 && !bus_open(bus))
+		return false;
+	bus.serial++;
+	memcpy(a.data + 8, &bus.serial, 4);
+	if (bus_write(bus, a.data, a.len))
+		return true;
+	bus_close(bus);
+	return false;
+}
+
+void run_dbus(Action &a) {
+	Bus &bus = buses[a.arg];
+	a.runs++;
+	// The bus may have restarted since we last used it
+	if (bus_send(bus, a) || bus_send(bus, a))
+		return;
+	a.failures++;
+	if (debug)
+		printf("Sending D-Bus message failed\n");
+}
+
+bool parse_dbus(Action &a, const char *cmd, bool signal) {
+	char *args = strdup(cmd);
+	std::vector<char *> words;
+	for (char *w = strtok(args, " "); w; w = strtok(NULL, " "))
+		words.push_back(w);
+	size_t i = 0;
+	a.arg = 0;
+	if (i < words.size() && !strcmp(words[i], "--system")) {
+		a.arg = 1;
+		i++;
+	}
+	const char *dest = NULL;
+	if (!signal && i < words.size())
+		dest = words[i++];
+	if (i + 2 > words.size())
+		return false;
+	std::string msg;
+	if (!dbus_message(msg, signal ? DBUS_SIGNAL : DBUS_METHOD_CALL, dest, words[i], words[i+1],
+				words.size() > i + 2 ? &words[i+2] : NULL, words.size() - i - 2))
+		return false;
+	free(args);
+	a.type = ACT_DBUS;
+	a.len = msg.size();
+	a.data = (char *)malloc(a.len);
+	memcpy(a.data, msg.data(), a.len);
+	return true;
+}
+
+// The parts of an @send event that depend on the server, redone on reconnect
+bool fill_send(Action &a) {
+	XEvent *ev = a.event;
+	if (ev->type == KeyPress && !(ev->xkey.keycode = XKeysymToKeycode(dpy, a.arg)))
+		return false;
+	ev->xkey.display = dpy;
+	ev->xkey.root = ROOT;
+	return true;
+}
+
+void refill_send(Action &a) {
+	if (a.type == ACT_SEND && !fill_send(a))
+		printf("Warning: No key for '%s' after reconnecting\n", a.cmd);
+}
+
+bool parse_send(Action &a, const char *args) {
+	char name[64], kind[16], what[64];
+	if (sscanf(args, "%63s %15s %63s", name, kind, what) != 3)
+		return false;
+	XEvent *ev = new XEvent;
+	memset(ev, 0, sizeof(XEvent));
+	a.event = ev;
+	if (!strcmp(kind, "key")) {
+		KeySym sym = XStringToKeysym(what);
+		if (sym == NoSymbol)
+			return false;
+		a.arg = sym;
+		ev->type = KeyPress;
+	} else if (!strcmp(kind, "button")) {
+		if (!(ev->xbutton.button = atoi(what)))
+			return false;
+		ev->type = ButtonPress;
+	} else {
+		return false;
+	}
+	// Key and button events have the same layout up to here
+	ev->xkey.time = CurrentTime;
+	ev->xkey.x = ev->xkey.y = 1;
+	ev->xkey.x_root = ev->xkey.y_root = 1;
+	ev->xkey.same_screen = True;
+	if (!fill_send(a))
+		return false;
+	a.type = ACT_SEND;
+	a.index = get_class_index(strdup(name));
+	need_clients = true;
+	return true;
+}
+
+// Where the shell will find the program a command starts with, or NULL
+char *resolve(const char *cmd) {
+	cmd += strspn(cmd, " \t");
+	size_t len = strcspn(cmd, " \t\n;&|<>()$`'\"\\*?[]{}~=#");
+	// Assignments, quoting and the like are beyond us
+	if (!len || (cmd[len] && !strchr(" \t\n;&|<>", cmd[len])))
+		return NULL;
+	std::string name(cmd, len);
+	struct stat st;
+	if (name.find('/') != std::string::npos) {
+		if (name[0] != '/' || stat(name.c_str(), &st) || !S_ISREG(st.st_mode))
+			return NULL;
+		return strdup(name.c_str());
+	}
+	const char *path = getenv("PATH");
+	if (!path)
+		path = "/usr/local/bin:/usr/bin:/bin";
+	while (1) {
+		size_t n = strcspn(path, ":");
+		std::string file = (n ? std::string(path, n) : std::string(".")) + "/" + name;
+		if (!stat(file.c_str(), &st) && S_ISREG(st.st_mode) && !access(file.c_str(), X_OK))
+			return strdup(file.c_str());
+		if (!path[n])
+			return NULL;
+		path += n + 1;
+	}
+}
+
+// Commands without anything for the shell to interpret get exec'd directly
+void parse_exec(Action &a, const char *exec) {
+	a.exec = exec;
+	a.binary = resolve(exec);
+	if (!a.binary || exec[strcspn(exec, ";&|<>()$`'\"\\*?[]{}~=#%\n")])
+		return;
+	// Without leading blanks, so that argv[0] is what to free
+	char *words = strdup(exec + strspn(exec, " \t"));
+	std::vector<char *> argv;
+	for (char *w = strtok(words, " \t"); w; w = strtok(NULL, " \t"))
+		argv.push_back(w);
+	a.argv = (char **)malloc((argv.size() + 1) * sizeof(char *));
+	std::copy(argv.begin(), argv.end(), a.argv);
+	a.argv[argv.size()] = NULL;
+}
+
+bool parse_action(Action &a, const char *cmd) {
+	a.cmd = cmd;
+	if (!*cmd) {
+		a.type = ACT_NONE;
+		return true;
+	}
+	if (*cmd != '@') {
+		a.type = ACT_CMD;
+		parse_exec(a, cmd);
+		return true;
+	}
+	if (!strncmp(cmd, "@scroll", 7) && (!cmd[7] || cmd[7] == ' ')) {
+		a.type = ACT_SCROLL;
+		a.arg = cmd[7] ? atoi(cmd + 8) : 16;
+		need_motion = true;
+		return a.arg > 0;
+	}
+	if (!strncmp(cmd, "@layer ", 7) && cmd[7]) {
+		a.type = ACT_LAYER;
+		a.layer = get_layer(cmd + 7);
+		return true;
+	}
+	if (!strncmp(cmd, "@latch ", 7)) {
+		a.type = ACT_LATCH;
+		a.arg = atoi(cmd + 7);
+		return a.arg > 0 && a.arg < MAX_BUTTONS;
+	}
+	if (!strcmp(cmd, "@close")) {
+		a.type = ACT_CLOSE;
+		return true;
+	}
+	if (!strcmp(cmd, "@minimize")) {
+		a.type = ACT_MINIMIZE;
+		return true;
+	}
+	if (!strcmp(cmd, "@maximize")) {
+		a.type = ACT_MAXIMIZE;
+		return true;
+	}
+	if (!strncmp(cmd, "@desktop ", 9) && cmd[9]) {
+		a.type = ACT_DESKTOP;
+		a.arg = atoi(cmd + 9);
+		return true;
+	}
+	if (!strncmp(cmd, "@switch ", 8) && cmd[8]) {
+		a.type = ACT_SWITCH;
+		a.arg = atoi(cmd + 8);
+		return true;
+	}
+	if (!strncmp(cmd, "@raise ", 7)) {
+		const char *name = cmd + 7;
+		const char *exec = strchr(name, ' ');
+		if (!exec || exec == name || !exec[1])
+			return false;
+		a.type = ACT_RAISE;
+		a.index = get_class_index(strndup(name, exec - name));
+		parse_exec(a, exec + 1);
+		need_clients = true;
+		return true;
+	}
+	if (!strncmp(cmd, "@send ", 6))
+		return parse_send(a, cmd + 6);
+	if (!strncmp(cmd, "@dbus ", 6))
+		return parse_dbus(a, cmd + 6, false);
+	if (!strncmp(cmd, "@dbus-signal ", 13))
+		return parse_dbus(a, cmd + 13, true);
+	if (!strncmp(cmd, "@write ", 7)) {
+		const char *path = cmd + 7;
+		const char *text = strchr(path, ' ');
+		if (!text || text == path)
+			return false;
+		a.type = ACT_WRITE;
+		a.path = strndup(path, text - path);
+		a.len = strlen(text + 1) + 1;
+		a.data = (char *)malloc(a.len);
+		memcpy(a.data, text + 1, a.len - 1);
+		a.data[a.len - 1] = '\n';
+		a.fd = -1;
+		return true;
+	}
+	printf("Error: Unknown action '%s'\n", cmd);
+	return false;
+}
+
+void parse_args(int argc, char **argv) {
+	if (argc == 2 && !strcmp(argv[1], "--profile")) {
+		metrics_addr = getenv("METRICS");
+		exit(print_profile());
+	}
+	if ((argc % 3) != 1 || argc <= 3) {
+		usage(argv[0]);
+		exit(EXIT_SUCCESS);
+	}
+	Layer *base = get_layer("");
+	for (int i = 0; 3*i+3 < argc; i++) {
+		Binding b;
+		memset(&b, 0, sizeof(b));
+		b.spec = argv[3*i+1];
+		b.layer = base;
+		if (!parse_action(b.press, argv[3*i+2]) || !parse_action(b.release, argv[3*i+3])) {
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+		char *spec = strdup(b.spec);
+		char *q = strtok(spec, ":");
+		b.button = q ? atoi(q) : 0;
+		if (!b.button || b.button >= MAX_BUTTONS) {
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+		while ((q = strtok(NULL, ":"))) {
+			if (!strncmp(q, "gesture=", 8) && (b.gesture = parse_gesture(q + 8))) {
+				need_motion = true;
+				continue;
+			}
+			if (!strncmp(q, "layer=", 6)) {
+				b.layer = get_layer(strdup(q + 6));
+				continue;
+			}
+			if (!strcmp(q, "toggle")) {
+				b.toggle = true;
+				continue;
+			}
+			if (!strncmp(q, "region=", 7) && q[7]) {
+				parse_region(b, strdup(q + 7));
+				need_monitors = true;
+				continue;
+			}
+			if (!strncmp(q, "class=", 6) && q[6]) {
+				b.class_name = strdup(q + 6);
+				continue;
+			}
+			printf("Error: Invalid qualifier '%s' in '%s'\n", q, b.spec);
+			exit(EXIT_FAILURE);
+		}
+		free(spec);
+		bindings.push_back(b);
+		Commands *&c = b.layer->buttons[b.button];
+		if (!c)
+			c = new Commands();
+		if (b.gesture)
+			c->gestures.push_back(&bindings.back());
+		else if (b.monitor_name || b.edges || b.class_name)
+			c->variants.push_back(&bindings.back());
+		else
+			c->plain = &bindings.back();
+	}
+	// With gestures, presses are only dispatched on release, too late to scroll
+	for (std::list<Binding>::iterator i = bindings.begin(); i != bindings.end(); i++)
+		if (i->press.type == ACT_SCROLL && !i->layer->buttons[i->button]->gestures.empty()) {
+			printf("Error: '%s' can't scroll, the button has gestures bound\n", i->spec);
+			exit(EXIT_FAILURE);
+		}
+	for (std::list<Layer>::iterator l = layers.begin(); l != layers.end(); l++)
+		for (int i = 0; i < MAX_BUTTONS; i++)
+			if (!l->buttons[i])
+				l->buttons[i] = base->buttons[i];
+	current_layer = base;
+	debug = !!getenv("DEBUG");
+	always_grab = !!getenv("ALWAYS_GRAB");
+	device_name = getenv("DEVICE");
+	metrics_addr = getenv("METRICS");
+	prespawn = !!getenv("PRESPAWN");
+}
+
+
+void grab_button(unsigned int button) {
+	XGrabButton(dpy, button, AnyModifier, ROOT, False, ButtonPressMask,
+			GrabModeSync, GrabModeAsync, None, None);
+	if (always_grab)
+		return;
+	for (std::list<XiDevice>::iterator j = devices.begin(); j != devices.end(); j++) {
+		if (button > j->num_buttons)
+			continue;
+		XGrabDeviceButton(dpy, j->dev, button, AnyModifier, NULL,
+				ROOT, False, j->num_classes, j->classes, GrabModeAsync, GrabModeAsync);
+	}
+}
+
+void ungrab_button(unsigned int button) {
+	XUngrabButton(dpy, button, AnyModifier, ROOT);
+	if (always_grab)
+		return;
+	for (std::list<XiDevice>::iterator j = devices.begin(); j != devices.end(); j++) {
+		if (button > j->num_buttons)
+			continue;
+		XUngrabDeviceButton(dpy, j->dev, button, AnyModifier, NULL, ROOT);
+	}
+}
+
+void grab_buttons() {
+	if (always_grab) {
+		printf("Grabbing XInput devices...\n");
+		for (std::list<XiDevice>::iterator j = devices.begin(); j != devices.end(); j++)
+			j->grab();
+	}
+	for (unsigned int i = 1; i < MAX_BUTTONS; i++)
+		if (current_layer->buttons[i])
+			grab_button(i);
+}
+
+// Only touch the grabs of buttons that are bound in one layer but not the other
+void switch_layer(Layer *l) {
+	if (l == current_layer)
+		l = &layers.front();
+	if (debug)
+		printf("Switching to layer '%s'\n", l->name);
+	for (unsigned int i = 1; i < MAX_BUTTONS; i++) {
+		if (current_layer->buttons[i] && !l->buttons[i])
+			ungrab_button(i);
+		if (!current_layer->buttons[i] && l->buttons[i])
+			grab_button(i);
+	}
+	current_layer = l;
+}
+
+/*
+ * @write keeps its file open.  FIFOs lose their reader and sysfs files can
+ * go away with the device, so on any error we reopen once and try again.
+ * Without O_NONBLOCK, opening a FIFO would wait for a reader; this way it
+ * just fails and we try again next time.
+ */
+bool write_once(Action &a) {
+	if (a.fd < 0) {
+		a.fd = open(a.path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+		if (a.fd < 0)
+			return false;
+		a.seekable = lseek(a.fd, 0, SEEK_CUR) >= 0;
+	}
+	// sysfs wants each value written from the start
+	ssize_t n = a.seekable ? pwrite(a.fd, a.data, a.len, 0) : write(a.fd, a.data, a.len);
+	if (n == a.len)
+		return true;
+	close(a.fd);
+	a.fd = -1;
+	return false;
+}
+
+void run_write(Action &a) {
+	a.runs++;
+	if (write_once(a) || write_once(a))
+		return;
+	a.failures++;
+	if (debug)
+		printf("Writing to %s failed: %s\n", a.path, strerror(errno));
+}
+
+/*
+ * CPU=<list> keeps us on the given CPUs, e.g. "2" or "2-3,6" (CPU=isolated
+ * uses the ones in the isolcpus= list).  Commands then run where we would
+ * have run without it, minus our CPUs unless that leaves none, or on
+ * EXEC_CPU=<list>, from before they exec.  We pin ourselves before
+ * connecting or allocating anything, so memory ends up on the local node.
+ */
+bool pin_exec;
+cpu_set_t exec_cpus;
+
+bool parse_cpus(const char *list, cpu_set_t &set) {
+	CPU_ZERO(&set);
+	while (*list && *list != '\n') {
+		char *end;
+		long first = strtol(list, &end, 10), last = first;
+		if (end == list)
+			return false;
+		if (*end == '-') {
+			list = end + 1;
+			last = strtol(list, &end, 10);
+			if (end == list)
+				return false;
+		}
+		if (first < 0 || last < first || last >= CPU_SETSIZE)
+			return false;
+		for (long i = first; i <= last; i++)
+			CPU_SET(i, &set);
+		list = end + (*end == ',');
+		if (*end && *end != ',' && *end != '\n')
+			return false;
+	}
+	return CPU_COUNT(&set) > 0;
+}
+
+void init_affinity() {
+	sched_getaffinity(0, sizeof(exec_cpus), &exec_cpus);
+	const char *cpu = getenv("CPU");
+	char isolated[256] = "";
+	if (cpu && !strcmp(cpu, "isolated")) {
+		FILE *f = fopen("/sys/devices/system/cpu/isolated", "r");
+		if (f) {
+			if (!fgets(isolated, sizeof(isolated), f))
+				*isolated = 0;
+			fclose(f);
+		}
+		cpu = *isolated && *isolated != '\n' ? isolated : NULL;
+		if (!cpu)
+			printf("Warning: No isolated CPUs, not pinning\n");
+	}
+	cpu_set_t set;
+	if (cpu && !parse_cpus(cpu, set)) {
+		printf("Error: Invalid CPU list %s\n", cpu);
+		exit(EXIT_FAILURE);
+	}
+	if (cpu && sched_setaffinity(0, sizeof(set), &set)) {
+		printf("Warning: Can't run on CPUs %s: %s\n", cpu, strerror(errno));
+	} else if (cpu) {
+		pin_exec = true;
+		cpu_set_t rest;
+		CPU_XOR(&rest, &exec_cpus, &set);
+		CPU_AND(&rest, &rest, &exec_cpus);
+		if (CPU_COUNT(&rest))
+			exec_cpus = rest;
+	}
+	const char *exec = getenv("EXEC_CPU");
+	if (exec && !parse_cpus(exec, exec_cpus)) {
+		printf("Error: Invalid CPU list %s\n", exec);
+		exit(EXIT_FAILURE);
+	}
+	if (exec)
+		pin_exec = true;
+}
+
+extern char **environ;
+posix_spawnattr_t spawn_attr;
+
+// We ignore SIGPIPE, the commands we run shouldn't
+void init_spawn() {
+	sigset_t sigs;
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGPIPE);
+	posix_spawnattr_init(&spawn_attr);
+	posix_spawnattr_setsigdefault(&spawn_attr, &sigs);
+	posix_spawnattr_setflags(&spawn_attr, POSIX_SPAWN_SETSIGDEF);
+	signal(SIGPIPE, SIG_IGN);
+}
+
+/*
+ * posix_spawn(), unless we're pinned: children inherit our affinity, and it
+ * has to be changed before exec, or the program would be loaded on our CPU.
+ * posix_spawn() can't do that, so we do what it does, with vfork().
+ */
+int spawn(pid_t *pid, const char *path, char **argv) {
+	if (!pin_exec)
+		return posix_spawn(pid, path, NULL, &spawn_attr, argv, environ);
+	volatile int err = 0;
+	pid_t child = vfork();
+	if (!child) {
+		sched_setaffinity(0, sizeof(exec_cpus), &exec_cpus);
+		signal(SIGPIPE, SIG_DFL);
+		execve(path, argv, environ);
+		err = errno;	// we still share our parent's memory
+		_exit(127);
+	}
+	if (child < 0)
+		return errno;
+	if (err) {
+		while (waitpid(child, NULL, 0) < 0 && errno == EINTR);
+		return err;
+	}
+	*pid = child;
+	return 0;
+}
 
-struct XiDevice {
-	XDevice *dev;
-	XEventClass classes[2];
-	int press, release;
-	unsigned int num_buttons;
-	std::set<unsigned int> status;
+void wait_cmd(Action &a, pid_t pid, long long started) {
+	int status;
+	while (waitpid(pid, &status, 0) < 0)
+		if (errno != EINTR) {
+			a.failures++;
+			return;
+		}
+	a.runtime.add(now_us() - started);
+	trace("run", started, now_us() - started, pid, 0, a.cmd, pid);
+	if (WIFEXITED(status))
+		a.exits[WEXITSTATUS(status)]++;
+	else
+		a.signals++;
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		a.failures++;
+}
 
-	void grab() {
-		if (debug)
-			printf("Grabbing device %ld\n", dev->device_id);
-		int status = XGrabDevice(dpy, dev, ROOT, False, 2, classes,
-				GrabModeAsync, GrabModeAsync, CurrentTime);
-		switch (status) {
-			case GrabSuccess:
-				break;
-			case AlreadyGrabbed:
-				printf("Grab error: Already grabbed\n");
-				break;
-			case GrabNotViewable:
-				printf("Grab error: Not viewable\n");
-				break;
-			case GrabFrozen:
-				printf("Grab error: Frozen\n");
-				break;
-			case GrabInvalidTime:
-				printf("Grab error: Invalid Time\n");
-				break;
-			default:
-				printf("Grab error: Unknown\n");
+bool release_cmd(Action &a, long long input, unsigned int button, long device, Time t);
+
+void lookup_again(Action &a) {
+	if (!a.exec)
+		return;
+	free((char *)a.binary);
+	a.binary = resolve(a.exec);
+}
+
+// Like system(), but we want to know how long things took
+// The button, device and time of the event are only passed on to the probe
+void run_cmd(Action &a, long long input, unsigned int button, long device, Time t) {
+	if (a.parked && release_cmd(a, input, button, device, t))
+		return;
+	const char *argv[] = { "sh", "-c", a.exec, NULL };
+	pid_t pid;
+	long long start = now_us();
+	int err = ENOENT;
+	if (a.argv && a.binary) {
+		err = spawn(&pid, a.binary, a.argv);
+		// It moved, or went away and the shell gets to complain about it
+		if (err == ENOENT) {
+			lookup_again(a);
+			if (a.binary)
+				err = spawn(&pid, a.binary, a.argv);
 		}
+		// A script without #!, which only the shell knows how to run
+		if (err == ENOEXEC) {
+			free(a.argv[0]);
+			free(a.argv);
+			a.argv = NULL;
+		}
+	}
+	if (err == ENOENT || err == ENOEXEC)
+		err = spawn(&pid, "/bin/sh", (char **)argv);
+	long long started = now_us();
+	stats.spawn.add(started - start);
+	a.launch.add(started - input);
+	a.runs++;
+	if (err) {
+		fprintf(stderr, "Error: Can't run '%s': %s\n", a.cmd, strerror(err));
+		a.failures++;
+		return;
 	}
+	trace("spawn", start, started - start, 0, 0, a.cmd);
+	DTRACE_PROBE6(bindbutton, spawn, pid, a.cmd, started - input, button, device, t);
+	wait_cmd(a, pid, started);
+}
 
-	void ungrab() {
-		if (debug)
-			printf("Ungrabbing device %ld\n", dev->device_id);
-		XUngrabDevice(dpy, dev, CurrentTime);
+/*
+ * With PRESPAWN set, the shell for a release command is started as soon as
+ * the button goes down and blocks reading a pipe, so all that is left to do
+ * on release is write a byte to it.  Closing the pipe instead makes the
+ * shell exit without running anything.
+ */
+void park_cmd(Action &a) {
+	if (a.parked)
+		return;
+	// The shell gets the pipe's fd as $1, file actions would mean a malloc
+	if (!a.script) {
+		const char *wait = "read _ <&$1 || exit 0\neval \"exec $1<&-\"\nset --\n";
+		a.script = (char *)malloc(strlen(wait) + strlen(a.exec) + 1);
+		strcpy(a.script, wait);
+		strcat(a.script, a.exec);
 	}
-};
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC) < 0)
+		return;
+	// Nothing else gets spawned before we close it again
+	fcntl(fds[0], F_SETFD, 0);
+	char fd[16];
+	snprintf(fd, sizeof(fd), "%d", fds[0]);
+	const char *argv[] = { "sh", "-c", a.script, "sh", fd, NULL };
+	pid_t pid;
+	long long start = now_us();
+	int err = spawn(&pid, "/bin/sh", (char **)argv);
+	stats.spawn.add(now_us() - start);
+	close(fds[0]);
+	if (err) {
+		close(fds[1]);
+		return;
+	}
+	a.parked = pid;
+	a.trigger = fds[1];
+}
 
-std::list<XiDevice> devices;
+void cancel_cmd(Action &a) {
+	if (!a.parked)
+		return;
+	close(a.trigger);
+	while (waitpid(a.parked, NULL, 0) < 0 && errno == EINTR);
+	a.parked = 0;
+}
 
-struct Commands {
-	const char *press;
-	const char *release;
-};
+// Returns false if the shell is gone, so that the caller can start a new one
+bool release_cmd(Action &a, long long input, unsigned int button, long device, Time t) {
+	pid_t pid = a.parked;
+	a.parked = 0;
+	long long started = now_us();
+	bool ok = write(a.trigger, "\n", 1) == 1;
+	close(a.trigger);
+	if (!ok) {
+		while (waitpid(pid, NULL, 0) < 0 && errno == EINTR);
+		return false;
+	}
+	a.launch.add(started - input);
+	a.runs++;
+	trace("trigger", started, now_us() - started, 0, 0, a.cmd);
+	DTRACE_PROBE6(bindbutton, spawn, pid, a.cmd, started - input, button, device, t);
+	wait_cmd(a, pid, started);
+	return true;
+}
 
-std::map<unsigned int, Commands> commands;
+/*
+ * Programs that show up earlier in PATH than the ones we found would be run
+ * by the shell instead, so we keep an eye on the PATH directories and look
+ * everything up again when one of them changes.
+ */
+void path_changed(void *);
 
-void init_xi() {
-	int n;
-	XDeviceInfo *devs = XListInputDevices(dpy, &n);
-	if (!devs)
-		exit(EXIT_FAILURE);
+Watch path_watch = { -1, path_changed, NULL };
 
-	for (int i = 0; i < n; i++) {
-		if (devs[i].use == IsXKeyboard || devs[i].use == IsXPointer)
-			continue;
+void path_changed(void *) {
+	char buf[4096];
+	while (read(path_watch.fd, buf, sizeof(buf)) > 0);
+	for (std::list<Binding>::iterator i = bindings.begin(); i != bindings.end(); i++) {
+		lookup_again(i->press);
+		lookup_again(i->release);
+	}
+	if (debug)
+		printf("PATH changed, looked up commands again\n");
+}
 
-		XiDevice dev;
+void init_path_watch() {
+	bool any = false;
+	for (std::list<Binding>::iterator i = bindings.begin(); i != bindings.end(); i++)
+		any = any || i->press.argv || i->release.argv;
+	if (!any)
+		return;
+	path_watch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (path_watch.fd < 0)
+		return;
+	const char *path = getenv("PATH");
+	while (path && *path) {
+		size_t n = strcspn(path, ":");
+		if (n)
+			inotify_add_watch(path_watch.fd, std::string(path, n).c_str(),
+					IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB);
+		path += n + !!path[n];
+	}
+	watches.push_back(&path_watch);
+}
 
-		dev.num_buttons = 0;
-		XAnyClassPtr any = (XAnyClassPtr) (devs[i].inputclassinfo);
-		for (int j = 0; j < devs[i].num_classes; j++) {
-			if (any->c_class == ButtonClass) {
-				XButtonInfo *info = (XButtonInfo *)any;
-				dev.num_buttons = info->num_buttons;
-			}
-			any = (XAnyClassPtr) ((char *) any + any->length);
-		}
-		if (!dev.num_buttons)
+/*
+ * Commands that haven't run in a while start slowly because their programs
+ * have dropped out of the page cache.  WARM=mlock locks the shell and every
+ * program we found for a binding into memory, WARM=<seconds> reads them
+ * ahead that often instead (so we do wake up when idle then).  With
+ * WARM_LIBS set, the shared libraries they load are included.
+ */
+std::set<std::string> warm_files;
+std::vector<std::string> lib_dirs;
+long long warm_interval;
+
+void warm();
+
+Timer warm_timer = { 0, warm };
+
+void warm() {
+	for (std::set<std::string>::iterator i = warm_files.begin(); i != warm_files.end(); i++) {
+		int fd = open(i->c_str(), O_RDONLY | O_CLOEXEC);
+		struct stat st;
+		if (fd < 0)
 			continue;
+		if (!fstat(fd, &st))
+			readahead(fd, 0, st.st_size);
+		close(fd);
+	}
+	arm(warm_timer, warm_interval);
+}
 
-		if (device_name && strcasecmp(device_name, devs[i].name))
+// Libraries are looked for where ours are, which is good enough for most
+void init_lib_dirs() {
+	const char *env = getenv("LD_LIBRARY_PATH");
+	while (env && *env) {
+		size_t n = strcspn(env, ":");
+		if (n)
+			lib_dirs.push_back(std::string(env, n));
+		env += n + !!env[n];
+	}
+	FILE *maps = fopen("/proc/self/maps", "r");
+	char line[512];
+	while (maps && fgets(line, sizeof(line), maps)) {
+		char *file = strchr(line, '/');
+		char *slash = file ? strrchr(file, '/') : NULL;
+		if (!file || !strstr(slash, ".so"))
 			continue;
+		std::string dir(file, slash - file);
+		if (std::find(lib_dirs.begin(), lib_dirs.end(), dir) == lib_dirs.end())
+			lib_dirs.push_back(dir);
+	}
+	if (maps)
+		fclose(maps);
+	lib_dirs.push_back("/lib");
+	lib_dirs.push_back("/usr/lib");
+}
 
-		dev.dev = XOpenDevice(dpy, devs[i].id);
-		if (!dev.dev) {
-			printf("Opening Device %s failed.\n", devs[i].name);
+// Add an ELF file and, recursively, its DT_NEEDED entries
+void add_warm_file(const std::string &file, bool libs) {
+	if (!warm_files.insert(file).second || !libs)
+		return;
+	int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) || (size_t)st.st_size < sizeof(ElfW(Ehdr))) {
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return;
+	const char *base = (const char *)map;
+	const ElfW(Ehdr) *eh = (const ElfW(Ehdr) *)base;
+	std::vector<std::string> needed;
+	if (!memcmp(eh->e_ident, ELFMAG, SELFMAG) && eh->e_ident[EI_CLASS] == (sizeof(void *) == 8 ? ELFCLASS64 : ELFCLASS32) &&
+			eh->e_phoff + eh->e_phnum * sizeof(ElfW(Phdr)) <= (size_t)st.st_size) {
+		const ElfW(Phdr) *ph = (const ElfW(Phdr) *)(base + eh->e_phoff);
+		const ElfW(Dyn) *dyn = NULL;
+		size_t dyn_count = 0;
+		for (int i = 0; i < eh->e_phnum; i++)
+			if (ph[i].p_type == PT_DYNAMIC && ph[i].p_offset + ph[i].p_filesz <= (size_t)st.st_size) {
+				dyn = (const ElfW(Dyn) *)(base + ph[i].p_offset);
+				dyn_count = ph[i].p_filesz / sizeof(ElfW(Dyn));
+			}
+		// The string table is given as an address, find it in the file
+		ElfW(Addr) strtab = 0;
+		for (size_t i = 0; i < dyn_count && dyn[i].d_tag != DT_NULL; i++)
+			if (dyn[i].d_tag == DT_STRTAB)
+				strtab = dyn[i].d_un.d_ptr;
+		size_t strings = 0;
+		for (int i = 0; i < eh->e_phnum; i++)
+			if (ph[i].p_type == PT_LOAD && strtab >= ph[i].p_vaddr && strtab < ph[i].p_vaddr + ph[i].p_filesz)
+				strings = strtab - ph[i].p_vaddr + ph[i].p_offset;
+		for (size_t i = 0; strings && i < dyn_count && dyn[i].d_tag != DT_NULL; i++)
+			if (dyn[i].d_tag == DT_NEEDED && strings + dyn[i].d_un.d_val < (size_t)st.st_size)
+				needed.push_back(std::string(base + strings + dyn[i].d_un.d_val,
+							strnlen(base + strings + dyn[i].d_un.d_val, st.st_size - strings - dyn[i].d_un.d_val)));
+	}
+	munmap(map, st.st_size);
+	for (std::vector<std::string>::iterator i = needed.begin(); i != needed.end(); i++)
+		for (std::vector<std::string>::iterator j = lib_dirs.begin(); j != lib_dirs.end(); j++) {
+			std::string lib = *j + "/" + *i;
+			if (!access(lib.c_str(), R_OK)) {
+				add_warm_file(lib, libs);
+				break;
+			}
+		}
+}
+
+void init_warm() {
+	const char *mode = getenv("WARM");
+	if (!mode)
+		return;
+	bool libs = !!getenv("WARM_LIBS");
+	if (libs)
+		init_lib_dirs();
+	add_warm_file("/bin/sh", libs);
+	for (std::list<Binding>::iterator i = bindings.begin(); i != bindings.end(); i++) {
+		if (i->press.binary)
+			add_warm_file(i->press.binary, libs);
+		if (i->release.binary)
+			add_warm_file(i->release.binary, libs);
+	}
+	if (debug)
+		for (std::set<std::string>::iterator i = warm_files.begin(); i != warm_files.end(); i++)
+			printf("Keeping %s warm\n", i->c_str());
+	if (strcmp(mode, "mlock")) {
+		warm_interval = atof(mode) * 1000000;
+		if (warm_interval <= 0) {
+			printf("Error: WARM must be \"mlock\" or a number of seconds\n");
+			exit(EXIT_FAILURE);
+		}
+		timers.push_back(&warm_timer);
+		warm();
+		return;
+	}
+	// The mappings stay around for good, the locks along with them
+	for (std::set<std::string>::iterator i = warm_files.begin(); i != warm_files.end(); i++) {
+		int fd = open(i->c_str(), O_RDONLY | O_CLOEXEC);
+		struct stat st;
+		if (fd < 0 || fstat(fd, &st) || !st.st_size) {
+			if (fd >= 0)
+				close(fd);
 			continue;
 		}
+		void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (map == MAP_FAILED || mlock(map, st.st_size))
+			printf("Warning: Can't lock %s into memory: %s\n", i->c_str(), strerror(errno));
+	}
+}
 
-		DeviceButtonPress(dev.dev, dev.press, dev.classes[0]);
-		DeviceButtonRelease(dev.dev, dev.release, dev.classes[1]);
+/*
+ * If METRICS is set, serve OpenMetrics text on it: a UNIX socket if it is a
+ * path, otherwise a TCP port on localhost.  The text is only put together
+ * when someone asks for it.
+ */
+void serve_control(void *);
+void answer_control(void *);
 
-		devices.push_back(dev);
+Watch control = { -1, serve_control, NULL };
+Watch client = { -1, answer_control, NULL };	// waiting for its request
+
+// Listen on METRICS, or connect to it if we are the client
+int open_control(bool server) {
+	struct sockaddr_un un;
+	struct sockaddr_in in;
+	struct sockaddr *addr;
+	socklen_t len;
+	if (metrics_addr[0] == '/') {
+		memset(&un, 0, sizeof(un));
+		un.sun_family = AF_UNIX;
+		strncpy(un.sun_path, metrics_addr, sizeof(un.sun_path) - 1);
+		addr = (struct sockaddr *)&un;
+		len = sizeof(un);
+		// A socket left behind by an earlier run, but nothing else
+		struct stat st;
+		if (server && !lstat(metrics_addr, &st) && S_ISSOCK(st.st_mode))
+			unlink(metrics_addr);
+	} else {
+		char *end;
+		long port = strtol(metrics_addr, &end, 10);
+		if (end == metrics_addr || *end || port < 1 || port > 65535) {
+			printf("Error: METRICS must be a path or a port number\n");
+			return -1;
+		}
+		memset(&in, 0, sizeof(in));
+		in.sin_family = AF_INET;
+		in.sin_port = htons(port);
+		in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		addr = (struct sockaddr *)&in;
+		len = sizeof(in);
 	}
-	XFreeDeviceList(devs);
-	if (devices.size() == 0) {
-		printf("Error: No devices found\n");
+	int fd = socket(addr->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	if (!server) {
+		if (connect(fd, addr, len) == 0)
+			return fd;
+	} else {
+		int one = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(fd, addr, len) == 0 && listen(fd, 4) == 0) {
+			fcntl(fd, F_SETFL, O_NONBLOCK);
+			return fd;
+		}
+	}
+	close(fd);
+	return -1;
+}
+
+void init_control() {
+	if (!metrics_addr)
+		return;
+	control.fd = open_control(true);
+	if (control.fd < 0) {
+		printf("Error: Can't listen on %s\n", metrics_addr);
 		exit(EXIT_FAILURE);
 	}
+	watches.push_back(&control);
+	watches.push_back(&client);
 }
 
-void usage(const char *cmd) {
-	printf("Usage: %s <button 1> <press command 1> <release command 1>\n", cmd);
-	printf("          [<button 2> <press command 2> <release command 2>]...\n");
+void write_histogram(FILE *f, const char *name, LatencyHistogram &h) {
+	unsigned long count = 0;
+	fprintf(f, "# TYPE %s histogram\n# UNIT %s seconds\n", name, name);
+	for (int i = 0; i < LatencyHistogram::N; i++) {
+		count += h.buckets[i];
+		fprintf(f, "%s_bucket{le=\"%g\"} %lu\n", name, latency_bounds[i] / 1e6, count);
+	}
+	count += h.buckets[LatencyHistogram::N];
+	fprintf(f, "%s_bucket{le=\"+Inf\"} %lu\n", name, count);
+	fprintf(f, "%s_count %lu\n%s_sum %g\n", name, count, name, h.sum / 1e6);
 }
 
-void parse_args(int argc, char **argv) {
-	if ((argc % 3) != 1 || argc <= 3) {
-		usage(argv[0]);
-		exit(EXIT_SUCCESS);
+void write_metrics(FILE *f) {
+	fprintf(f, "# TYPE bindbutton_events counter\n");
+	for (int i = 0; i < EV_TYPES; i++)
+		fprintf(f, "bindbutton_events_total{type=\"%s\"} %lu\n", event_types[i], stats.events[i]);
+	fprintf(f, "# TYPE bindbutton_combines counter\nbindbutton_combines_total %lu\n", stats.combines);
+	fprintf(f, "# TYPE bindbutton_replays counter\nbindbutton_replays_total %lu\n", stats.replays);
+	fprintf(f, "# TYPE bindbutton_grabs counter\nbindbutton_grabs_total %lu\n", stats.grabs);
+	fprintf(f, "# TYPE bindbutton_grab_failures counter\nbindbutton_grab_failures_total %lu\n", stats.grab_failures);
+	fprintf(f, "# TYPE bindbutton_wakeups counter\nbindbutton_wakeups_total %lu\n", stats.wakeups);
+	// What the kernel saw, to check that an idle bindbutton really sleeps
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	fprintf(f, "# TYPE bindbutton_context_switches counter\n");
+	fprintf(f, "bindbutton_context_switches_total{kind=\"voluntary\"} %ld\n", ru.ru_nvcsw);
+	fprintf(f, "bindbutton_context_switches_total{kind=\"involuntary\"} %ld\n", ru.ru_nivcsw);
+	fprintf(f, "# TYPE bindbutton_reconnects counter\nbindbutton_reconnects_total %lu\n", stats.reconnects);
+	fprintf(f, "# TYPE bindbutton_spins counter\nbindbutton_spins_total %lu\n", stats.spins);
+	fprintf(f, "# TYPE bindbutton_spin_hits counter\nbindbutton_spin_hits_total %lu\n", stats.spin_hits);
+	fprintf(f, "# TYPE bindbutton_spin_seconds counter\nbindbutton_spin_seconds_total %.6f\n", stats.spin_us / 1e6);
+	write_histogram(f, "bindbutton_spawn_seconds", stats.spawn);
+	write_histogram(f, "bindbutton_latency_seconds", stats.latency);
+	fprintf(f, "# TYPE bindbutton_binding_runs counter\n");
+	for (std::list<Binding>::iterator i = bindings.begin(); i != bindings.end(); i++) {
+		fprintf(f, "bindbutton_binding_runs_total{binding=\"%s\",edge=\"press\"} %lu\n", i->spec, i->press.runs);
+		fprintf(f, "bindbutton_binding_runs_total{binding=\"%s\",edge=\"release\"} %lu\n", i->spec, i->release.runs);
 	}
-	for (int i = 0; 3*i+3 < argc; i++) {
-		Commands cmds;
-		cmds.press = argv[3*i+2];
-		cmds.release = argv[3*i+3];
-		int button = atoi(argv[3*i+1]);
-		if (!button) {
-			usage(argv[0]);
-			exit(EXIT_FAILURE);
-		}
-		commands[button] = cmds;
+	fprintf(f, "# TYPE bindbutton_binding_failures counter\n");
+	for (std::list<Binding>::iterator i = bindings.begin(); i != bindings.end(); i++) {
+		fprintf(f, "bindbutton_binding_failures_total{binding=\"%s\",edge=\"press\"} %lu\n", i->spec, i->press.failures);
+		fprintf(f, "bindbutton_binding_failures_total{binding=\"%s\",edge=\"release\"} %lu\n", i->spec, i->release.failures);
 	}
-	debug = !!getenv("DEBUG");
-	always_grab = !!getenv("ALWAYS_GRAB");
-	device_name = getenv("DEVICE");
+	fprintf(f, "# EOF\n");
 }
 
+struct Profile {
+	const char *binding;
+	const char *edge;
+	Action *a;
+	long long cost() const { return a->launch.sum + a->runtime.sum; }
+	bool operator<(const Profile &p) const { return cost() > p.cost(); }
+};
+
+// A quantile in ms, or how far the histogram goes if it's beyond that
+template <const long long *bounds>
+const char *format_quantile(char *buf, size_t size, Histogram<bounds> &h, double q) {
+	long long us = h.quantile(q);
+	if (us < 0)
+		snprintf(buf, size, ">%gs", bounds[HISTOGRAM_BUCKETS - 1] / 1e6);
+	else
+		snprintf(buf, size, "%.1fms", us / 1e3);
+	return buf;
+}
 
-void grab_buttons() {
-	if (always_grab) {
-		printf("Grabbing XInput devices...\n");
-		for (std::list<XiDevice>::iterator j = devices.begin(); j != devices.end(); j++)
-			j->grab();
+// One line per binding edge, most expensive first
+void write_profile(FILE *f) {
+	std::vector<Profile> rows;
+	for (std::list<Binding>::iterator i = bindings.begin(); i != bindings.end(); i++) {
+		Profile p = { i->spec, "press", &i->press };
+		rows.push_back(p);
+		p.edge = "release";
+		p.a = &i->release;
+		rows.push_back(p);
 	}
-	for (std::map<unsigned int, Commands>::iterator i = commands.begin(); i != commands.end(); i++) {
-		XGrabButton(dpy, i->first, AnyModifier, ROOT, False, ButtonPressMask,
-				GrabModeSync, GrabModeAsync, None, None);
-		if (always_grab)
-			continue;
-		for (std::list<XiDevice>::iterator j = devices.begin(); j != devices.end(); j++) {
-			if (i->first > j->num_buttons)
+	std::sort(rows.begin(), rows.end());
+	fprintf(f, "%-12s %-7s %6s %9s %9s %9s %9s %8s  %-16s %s\n", "binding", "edge", "runs",
+			"launch50", "launch99", "run50", "run99", "total", "exit codes", "command");
+	for (std::vector<Profile>::iterator i = rows.begin(); i != rows.end(); i++) {
+		Action *a = i->a;
+		char exits[64] = "";
+		int n = 0;
+		for (int c = 0; c < 256; c++)
+			if (a->exits[c] && n < (int)sizeof(exits))
+				n += snprintf(exits + n, sizeof(exits) - n, "%s%d:%lu", n ? "," : "", c, a->exits[c]);
+		if (a->signals && n < (int)sizeof(exits))
+			snprintf(exits + n, sizeof(exits) - n, "%ssig:%lu", n ? "," : "", a->signals);
+		char q[4][16];
+		fprintf(f, "%-12s %-7s %6lu %9s %9s %9s %9s %7.2fs  %-16s %s\n",
+				i->binding, i->edge, a->runs,
+				format_quantile(q[0], sizeof(q[0]), a->launch, 0.5),
+				format_quantile(q[1], sizeof(q[1]), a->launch, 0.99),
+				format_quantile(q[2], sizeof(q[2]), a->runtime, 0.5),
+				format_quantile(q[3], sizeof(q[3]), a->runtime, 0.99),
+				i->cost() / 1e6, exits, a->cmd);
+	}
+}
+
+// Quoted and escaped as JSON
+void write_json_string(FILE *f, const char *s) {
+	putc('"', f);
+	for (; *s; s++)
+		if (*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(f, "\\u%04x", *s);
+		else
+			putc(*s, f);
+	putc('"', f);
+}
+
+// Oldest first, in the format chrome://tracing and Perfetto load
+void write_trace(FILE *f) {
+	fprintf(f, "{\"traceEvents\":[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+			"\"args\":{\"name\":\"bindbutton\"}}", (int)getpid());
+	unsigned long first = trace_next > trace_size ? trace_next - trace_size : 0;
+	for (unsigned long i = first; i < trace_next; i++) {
+		TraceEvent &e = trace_ring[i % trace_size];
+		fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%lld,", e.name, e.dur < 0 ? "i" : "X", e.ts);
+		if (e.dur >= 0)
+			fprintf(f, "\"dur\":%lld,", e.dur);
+		fprintf(f, "\"pid\":%ld,\"tid\":%ld,\"args\":{\"button\":%d", e.pid, e.tid, e.button);
+		if (e.detail) {
+			fprintf(f, ",\"command\":");
+			write_json_string(f, e.detail);
+		}
+		fprintf(f, "}}");
+	}
+	fprintf(f, "\n]}\n");
+}
+
+// bindbutton --profile: ask the running instance for its profile
+int print_profile() {
+	if (!metrics_addr) {
+		printf("Error: METRICS is not set\n");
+		return EXIT_FAILURE;
+	}
+	int fd = open_control(false);
+	if (fd < 0) {
+		printf("Error: Can't connect to %s\n", metrics_addr);
+		return EXIT_FAILURE;
+	}
+	const char req[] = "GET /profile HTTP/1.0\r\n\r\n";
+	if (write(fd, req, sizeof(req) - 1) < 0)
+		return EXIT_FAILURE;
+	char buf[4096];
+	bool body = false;
+	ssize_t n;
+	while ((n = read(fd, buf, sizeof(buf) - 1)) > 0) {
+		buf[n] = 0;
+		char *p = buf;
+		if (!body) {
+			p = strstr(buf, "\r\n\r\n");
+			if (!p)
 				continue;
-			XGrabDeviceButton(dpy, j->dev, i->first, AnyModifier, NULL,
-					ROOT, False, 2, j->classes, GrabModeAsync, GrabModeAsync);
+			p += 4;
+			body = true;
 		}
+		fputs(p, stdout);
+	}
+	close(fd);
+	return EXIT_SUCCESS;
+}
+
+// One client at a time, a newer one replaces a client that never said anything
+void serve_control(void *) {
+	int fd = accept4(control.fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (fd < 0)
+		return;
+	if (client.fd >= 0)
+		close(client.fd);
+	client.fd = fd;
+}
+
+void answer_control(void *) {
+	char req[512];
+	ssize_t n = read(client.fd, req, sizeof(req) - 1);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	int fd = client.fd;
+	client.fd = -1;
+	if (n <= 0) {
+		close(fd);
+		return;
+	}
+	req[n] = 0;
+	// Don't let a stuck client hold up button events for long
+	struct timeval tv = { 0, 200000 };
+	fcntl(fd, F_SETFL, 0);
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	FILE *f = fdopen(fd, "w");
+	if (!strncmp(req, "GET /profile", 12)) {
+		fprintf(f, "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n\r\n");
+		write_profile(f);
+	} else if (!strncmp(req, "GET /trace", 10)) {
+		fprintf(f, "HTTP/1.0 200 OK\r\nContent-Type: application/json\r\n\r\n");
+		write_trace(f);
+	} else {
+		fprintf(f, "HTTP/1.0 200 OK\r\n"
+				"Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n\r\n");
+		write_metrics(f);
 	}
+	fclose(f);
+}
+
+/*
+ * With BUSY_POLL=<us>, we keep polling without sleeping for that long after
+ * handling events, so that the next click of a burst doesn't have to wait
+ * for the scheduler to wake us up.  This burns a CPU while it lasts, which
+ * the spin metrics account for.  Best combined with CPU.
+ */
+long long busy_poll;
+
+#if defined(__i386__) || defined(__x86_64__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() asm volatile("yield" ::: "memory")
+#else
+#define cpu_relax() asm volatile("" ::: "memory")
+#endif
+
+void init_busy_poll() {
+	const char *us = getenv("BUSY_POLL");
+	busy_poll = us ? atoll(us) : 0;
+}
+
+// Like poll() without a timeout, but gives up returning 0 at until
+int spin(struct pollfd *fds, int n, long long until) {
+	long long start = now_us();
+	int ret;
+	do {
+		for (int i = 0; i < 64; i++)
+			cpu_relax();
+		ret = poll(fds, n, 0);
+		stats.spins++;
+	} while (!ret && now_us() < until);
+	stats.spin_us += now_us() - start;
+	if (ret > 0)
+		stats.spin_hits++;
+	return ret;
 }
 
-void run_cmd(const char *cmd) {
-	if (system(cmd) == -1)
-		fprintf(stderr, "Error: system() failed\n");
+// Block until there are X events to read, serving everything else meanwhile
+void wait_for_events() {
+	long long spin_until = busy_poll ? now_us() + busy_poll : 0;
+	while (!XPending(dpy)) {
+		struct pollfd fds[1 + MAX_WATCHES];
+		Watch *watched[1 + MAX_WATCHES];
+		int n = 0;
+		fds[n].fd = ConnectionNumber(dpy);
+		fds[n++].events = POLLIN;
+		for (std::vector<Watch *>::iterator i = watches.begin(); i != watches.end(); i++) {
+			if ((*i)->fd < 0 || n > MAX_WATCHES)
+				continue;
+			watched[n] = *i;
+			fds[n].fd = (*i)->fd;
+			fds[n++].events = POLLIN;
+		}
+		int ret = spin_until ? spin(fds, n, spin_until) : 0;
+		spin_until = 0;
+		if (!ret) {
+			ret = poll(fds, n, poll_timeout());
+			stats.wakeups++;
+		}
+		run_timers();
+		if (ret <= 0)
+			continue;
+		for (int i = 1; i < n; i++)
+			if (fds[i].revents && watched[i]->fd == fds[i].fd)
+				watched[i]->ready(watched[i]->data);
+	}
 }
 
 struct Event {
@@ -182,11 +2459,29 @@ struct Event {
 	XiDevice *dev;
 	bool core;
 	Time t;
+	int x, y;
+	Window subwindow;
+	long device() const { return dev ? (long)dev->dev->device_id : -1; }
+	long track() const { return dev ? (long)dev->dev->device_id : 0; }
 	bool get();
+	void received();
+	long long latency();
 	void handle();
+	void dispatch(Commands &c);
+	bool matches(Binding *b, int px, int py, Window w);
+	Binding *select(Commands &c);
+	Binding *gesture(Commands &c);
+	void fire(Binding *b);
+	void run(Action &a);
 	bool combine(Event &ev);
 };
 
+void Event::received() {
+	DTRACE_PROBE4(bindbutton, get, is_press, button, device(), t);
+	long long input = server_to_mono(t);
+	trace("receive", input, now_us() - input, track(), button);
+}
+
 bool Event::get() {
 	XEvent ev;
 	XNextEvent(dpy, &ev);
@@ -197,10 +2492,39 @@ bool Event::get() {
 		dev = NULL;
 		core = true;
 		t = ev.xbutton.time;
+		x = ev.xbutton.x_root;
+		y = ev.xbutton.y_root;
+		subwindow = ev.xbutton.subwindow;
+		stats.events[EV_CORE_PRESS]++;
+		received();
 		if (debug)
 			printf("Button %d pressed (core)\n", button);
 		return true;
 	}
+	if (ev.type == PropertyNotify && ev.xproperty.window == clock_win) {
+		clock_sample(ev.xproperty.time);
+		return false;
+	}
+	if (ev.type == PropertyNotify) {
+		if (need_clients && ev.xproperty.window == ROOT && ev.xproperty.atom == atoms[NET_CLIENT_LIST])
+			update_clients();
+		else if (ev.xproperty.atom == XA_WM_CLASS)
+			forget_window(ev.xproperty.window);
+		return false;
+	}
+	if (ev.type == DestroyNotify) {
+		forget_window(ev.xdestroywindow.window);
+		return false;
+	}
+	// The rest of what StructureNotifyMask brings
+	if (ev.type == ConfigureNotify || ev.type == MapNotify || ev.type == UnmapNotify ||
+			ev.type == ReparentNotify || ev.type == GravityNotify || ev.type == CirculateNotify)
+		return false;
+	if (need_monitors && ev.type == rr_event_base + RRScreenChangeNotify) {
+		XRRUpdateConfiguration(&ev);
+		load_monitors();
+		return false;
+	}
 	for (std::list<XiDevice>::iterator j = devices.begin(); j != devices.end(); j++) {
 		if (ev.type == j->press) {
 			XDeviceButtonEvent* bev = (XDeviceButtonEvent *)&ev;
@@ -209,6 +2533,11 @@ bool Event::get() {
 			dev = &(*j);
 			core = false;
 			t = bev->time;
+			x = bev->x_root;
+			y = bev->y_root;
+			subwindow = bev->subwindow;
+			stats.events[EV_XI_PRESS]++;
+			received();
 			if (debug)
 				printf("Button %d pressed (Xi)\n", button);
 			return true;
@@ -220,41 +2549,249 @@ bool Event::get() {
 			dev = &(*j);
 			core = false;
 			t = bev->time;
+			x = bev->x_root;
+			y = bev->y_root;
+			subwindow = bev->subwindow;
+			stats.events[EV_XI_RELEASE]++;
+			received();
 			if (debug)
 				printf("Button %d released (Xi)\n", bev->button);
 			return true;
 		}
+		if (ev.type == j->motion) {
+			// Only the latest of the motion events we already have matters
+			XEvent next;
+			while (XEventsQueued(dpy, QueuedAlready)) {
+				XPeekEvent(dpy, &next);
+				if (next.type != j->motion)
+					break;
+				XNextEvent(dpy, &ev);
+			}
+			XDeviceMotionEvent* mev = (XDeviceMotionEvent *)&ev;
+			if (j->track.active)
+				j->track.add(mev->x_root, mev->y_root);
+			if (j->scroll_button)
+				j->scroll(mev->x_root, mev->y_root);
+			return false;
+		}
 	}
 	printf("Unknown event\n");
 	return false;
 }
 
+// Time from the physical input to now, in us
+long long Event::latency() {
+	return now_us() - server_to_mono(t);
+}
+
 void Event::handle() {
+	DTRACE_PROBE4(bindbutton, handle, is_press, button, device(), t);
 	if (core && is_press) {
+		long long start = now_us();
 		if (dev) {
 			XTestFakeButtonEvent(dpy, button, False, CurrentTime);
 			XAllowEvents(dpy, AsyncBoth, t);
 		} else {
 			XAllowEvents(dpy, ReplayPointer, t);
+			stats.replays++;
+			DTRACE_PROBE2(bindbutton, replay, button, t);
 		}
+		trace("allow-events", start, now_us() - start, track(), button);
 	}
 
 	if (!dev)
 		return;
 
-	std::map<unsigned int, Commands>::iterator i = commands.find(button);
-	if (i != commands.end())
-		run_cmd(is_press ? i->second.press : i->second.release);
+	// A release goes wherever the press went, even if the layer changed since
+	Commands *c = is_press ? current_layer->buttons[button] : dev->held[button];
+	dev->held[button] = is_press ? c : NULL;
+	if (c)
+		dispatch(*c);
 	if (always_grab)
 		return;
 	if (is_press) {
-		if (!dev->status.size())
-			dev->grab();
-		dev->status.insert(button);
+		if (dev->status.none())
+			dev->grab(button, t);
+		dev->status.set(button);
 	} else {
-		dev->status.erase(button);
-		if (!dev->status.size())
-			dev->ungrab();
+		dev->status.reset(button);
+		if (dev->status.none())
+			dev->ungrab(button, t);
+	}
+}
+
+void Event::dispatch(Commands &c) {
+	if (!is_press && button == dev->scroll_button)
+		dev->scroll_button = 0;
+	if (c.gestures.empty()) {
+		// The variant is picked on press, the release belongs to it
+		Binding *b = is_press ? select(c) : dev->chosen[button];
+		// We missed a release, don't leave its command waiting forever
+		if (is_press && dev->chosen[button] && dev->chosen[button] != b)
+			cancel_cmd(dev->chosen[button]->release);
+		dev->chosen[button] = is_press ? b : NULL;
+		if (!b)
+			return;
+		if (!b->toggle)
+			run(is_press ? b->press : b->release);
+		else if (is_press)
+			fire(b);
+		if (is_press && prespawn && !b->toggle && b->release.type == ACT_CMD)
+			park_cmd(b->release);
+		return;
+	}
+	// With gestures, we only know what to do once the button is released
+	if (is_press) {
+		dev->chosen[button] = select(c);
+		dev->track.start(x, y, subwindow);
+		return;
+	}
+	if (!dev->track.active)
+		return;
+	dev->track.add(x, y);
+	dev->track.active = false;
+	Binding *b = gesture(c);
+	if (!b)
+		b = dev->chosen[button];
+	dev->chosen[button] = NULL;
+	if (b)
+		fire(b);
+}
+
+// Whether the pointer was at px, py over w where the binding wants it
+bool Event::matches(Binding *b, int px, int py, Window w) {
+	if (b->monitor_name || b->edges) {
+		int m = find_monitor(px, py);
+		if (b->monitor_name && (m < 0 || m != b->monitor))
+			return false;
+		if ((find_edges(m, px, py) & b->edges) != b->edges)
+			return false;
+	}
+	if (b->class_name) {
+		WindowClass *wc = window_class(w);
+		if (!wc || (strcasecmp(wc->res_class, b->class_name) && strcasecmp(wc->res_name, b->class_name)))
+			return false;
+	}
+	return true;
+}
+
+Binding *Event::select(Commands &c) {
+	for (std::vector<Binding *>::iterator i = c.variants.begin(); i != c.variants.end(); i++)
+		if (matches(*i, x, y, subwindow))
+			return *i;
+	return c.plain;
+}
+
+// The best matching gesture binding, or NULL
+Binding *Event::gesture(Commands &c) {
+	Shape shape;
+	if (!make_shape(dev->track.p, dev->track.n, GESTURE_MIN_LENGTH, shape))
+		return NULL;
+	Binding *best = NULL;
+	float best_dist = GESTURE_MAX_DIST;
+	// Like all other bindings, gestures are about where the button was pressed
+	for (std::vector<Binding *>::iterator i = c.gestures.begin(); i != c.gestures.end(); i++) {
+		if (!matches(*i, dev->track.x0, dev->track.y0, dev->track.window))
+			continue;
+		float dist = shape_distance(shape, *(*i)->gesture);
+		if (debug)
+			printf("Gesture %s: distance %.3f\n", (*i)->spec, dist);
+		if (dist < best_dist) {
+			best_dist = dist;
+			best = *i;
+		}
+	}
+	return best;
+}
+
+// Run a binding all at once
+void Event::fire(Binding *b) {
+	if (b->toggle) {
+		run(b->toggled ? b->release : b->press);
+		b->toggled = !b->toggled;
+		return;
+	}
+	run(b->press);
+	run(b->release);
+}
+
+void Event::run(Action &a) {
+	if (a.type == ACT_NONE)
+		return;
+	long long l = latency();
+	stats.latency.add(l);
+	if (debug)
+		printf("Input-to-action latency: %.1fms\n", l / 1000.0);
+	switch (a.type) {
+		case ACT_SCROLL:
+			if (is_press)
+				dev->start_scroll(button, a.arg, x, y);
+			a.runs++;
+			break;
+		case ACT_LAYER:
+			switch_layer(a.layer);
+			a.runs++;
+			break;
+		case ACT_LATCH:
+			a.latched = !a.latched;
+			XTestFakeButtonEvent(dpy, a.arg, a.latched, CurrentTime);
+			a.runs++;
+			break;
+		case ACT_SWITCH:
+			send_wm(ROOT, NET_CURRENT_DESKTOP, a.arg, t);
+			a.runs++;
+			break;
+		case ACT_CLOSE:
+		case ACT_MINIMIZE:
+		case ACT_MAXIMIZE:
+		case ACT_DESKTOP: {
+			WindowClass *wc = window_class(subwindow);
+			a.runs++;
+			if (!wc) {
+				a.failures++;
+				break;
+			}
+			if (a.type == ACT_CLOSE)
+				send_wm(wc->client, NET_CLOSE_WINDOW, t, 2);
+			else if (a.type == ACT_MINIMIZE)
+				send_wm(wc->client, WM_CHANGE_STATE, IconicState);
+			else if (a.type == ACT_MAXIMIZE)
+				send_wm(wc->client, NET_WM_STATE, 2, atoms[NET_WM_STATE_MAXIMIZED_VERT],
+						atoms[NET_WM_STATE_MAXIMIZED_HORZ], 2);
+			else
+				send_wm(wc->client, NET_WM_DESKTOP, a.arg, 2);
+			break;
+		}
+		case ACT_WRITE:
+			run_write(a);
+			break;
+		case ACT_DBUS:
+			run_dbus(a);
+			break;
+		case ACT_SEND:
+			a.runs++;
+			if (a.index->windows.empty()) {
+				a.failures++;
+				break;
+			}
+			a.event->xany.window = a.index->windows.back();
+			XSendEvent(dpy, a.event->xany.window, True,
+					a.event->type == KeyPress ? KeyPressMask : ButtonPressMask, a.event);
+			a.event->type++;	// KeyRelease or ButtonRelease
+			XSendEvent(dpy, a.event->xany.window, True,
+					a.event->type == KeyRelease ? KeyReleaseMask : ButtonReleaseMask, a.event);
+			a.event->type--;
+			break;
+		case ACT_RAISE:
+			if (!a.index->windows.empty()) {
+				send_wm(a.index->windows.back(), NET_ACTIVE_WINDOW, 2, t);
+				a.runs++;
+			} else {
+				run_cmd(a, server_to_mono(t), button, device(), t);
+			}
+			break;
+		default:
+			run_cmd(a, server_to_mono(t), button, device(), t);
 	}
 }
 
@@ -267,28 +2804,97 @@ bool Event::combine(Event &ev) {
 		return false;
 	if (core && !dev && !ev.core && ev.dev) {
 		dev = ev.dev;
+		stats.combines++;
+		DTRACE_PROBE3(bindbutton, combine, button, device(), t);
+		trace("combine", now_us(), -1, track(), button);
 		return true;
 	}
 	if (!core && dev && ev.core && !ev.dev) {
 		core = ev.core;
+		stats.combines++;
+		DTRACE_PROBE3(bindbutton, combine, button, device(), t);
+		trace("combine", now_us(), -1, track(), button);
 		return true;
 	}
 	return false;
 }
 
+jmp_buf reconnect_env;
+
+// Xlib exits if this returns, so don't.  No destructors run on the way out,
+// so X calls must not be made while C++ objects are alive on the stack.
+int io_error(Display *) {
+	longjmp(reconnect_env, 1);
+}
+
+/*
+ * The X server went away.  The Display is beyond repair (XCloseDisplay would
+ * only end up in io_error again), so just close its socket, forget all state
+ * that refers to the old server and set everything up again.
+ */
+void reconnect() {
+	long long start = now_us();
+	printf("Lost connection to the X server, reconnecting...\n");
+	close(ConnectionNumber(dpy));
+	// Nobody is going to release the buttons we knew to be down
+	for (std::list<Binding>::iterator i = bindings.begin(); i != bindings.end(); i++)
+		cancel_cmd(i->release);
+	devices.clear();
+	memset(class_cache, 0, sizeof(class_cache));
+	clock_rtt = -1;
+	clock_sent = 0;
+	long long delay = 50000;
+	while (!(dpy = XOpenDisplay(NULL))) {
+		usleep(delay);
+		if (delay < 5000000)
+			delay *= 2;
+	}
+	init_atoms();
+	init_clock();
+	init_randr();
+	init_clients();
+	init_xi();
+	grab_buttons();
+	for (std::list<Binding>::iterator i = bindings.begin(); i != bindings.end(); i++) {
+		refill_send(i->press);
+		refill_send(i->release);
+	}
+	stats.reconnects++;
+	printf("Reconnected after %.2fs\n", (now_us() - start) / 1e6);
+}
+
 int main(int argc, char **argv) {
 	printf("bindbutton is deprecated.  Its functionality is now available in\neasystroke (version >= 0.4.0)\n\n");
+	init_affinity();
+	init_trace();
 	dpy = XOpenDisplay(NULL);
 
 	parse_args(argc, argv);
+	fatal_x_error = XSetErrorHandler(x_error);
+	init_spawn();
+	init_warm();
+	init_path_watch();
+	init_busy_poll();
+	init_atoms();
+	init_clock();
+	init_randr();
+	init_clients();
 	init_xi();
 	grab_buttons();
+	init_control();
 
 	Event queue[2];
-	int queue_size = 0;
+	int queue_size;
+
+	if (setjmp(reconnect_env))
+		reconnect();
+	XSetIOErrorHandler(io_error);
+	queue_size = 0;
 
 	while (1) {
 		while (queue_size < 2 && (!queue_size || XPending(dpy))) {
+			if (!queue_size)
+				wait_for_events();
 			if (queue[queue_size].get())
 				queue_size++;
 			else
@@ -299,5 +2905,7 @@ int main(int argc, char **argv) {
 		for (int i = 0; i < queue_size; i++)
 			queue[i].handle();
 		queue_size = 0;
+		clock_refresh();
+		run_timers();
 	}
 }